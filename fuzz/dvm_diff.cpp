@@ -0,0 +1,552 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+//Differential fuzzing of the execution engines.
+//
+//Generates random, valid programs and initial states, runs them on every 
+//engine in the engines table under an instruction budget, and compares the 
+//final registers, stack, memory and output with the reference engine (a 
+//plain dvm_run). When an engine disagrees, the program is minimized by 
+//removing instructions for as long as the engines still disagree, and then
+//printed along with the state it started from.
+//
+//Build:
+//  g++ -std=c++11 -O2 -Isrc src/*.cpp fuzz/dvm_diff.cpp -o dvm_diff -pthread
+//
+//Usage:
+//  dvm_diff [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/dvm.h"
+#include "../src/types.h"
+#include "../src/vecops.h"
+#include "../src/vm.h"
+
+#define BUDGET        5000
+#define MEMORY_SIZE   64
+#define STACK_SIZE    64
+#define SYMBOLS       16 //Most symbols are one of these, so jumps find their labels
+#define MAX_LENGTH    40
+
+////////////////////////////////////////////////////////////////////////////////
+
+//A generated program and the state it starts in
+typedef struct TestCase {
+  //One entry per instruction, including the data words of its operands
+  std::vector<std::vector<short> > code;
+  std::vector<ProgramConstant> constants;
+  DVMRegisters regs;
+  float memory[MEMORY_SIZE];
+} TestCase;
+
+//What's left after running a test case
+typedef struct Outcome {
+  DVMRegisters regs;
+  double stack[STACK_SIZE];
+  int stackSize;
+  float memory[MEMORY_SIZE];
+  std::string output;
+  bool finished;
+} Outcome;
+
+typedef void (*ENGINEFN)(const TestCase &t, Outcome &out);
+
+typedef struct Engine {
+  const char *name;
+  ENGINEFN run;
+} Engine;
+
+//Where PRINT output currently goes
+static std::string *capture = 0;
+
+static void capture_output(const char *text) {
+  if (capture) {
+    *capture += text;
+  }
+}
+
+//A deterministic host function for CALL #1
+static void host_fn(double *stack, int size) {
+  if (size > 0) {
+    stack[size - 1] = stack[size - 1] * 2 + 1;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Engines
+
+static ProgramSource to_source(const TestCase &t) {
+  ProgramSource src;
+  src.programSize = 0;
+  for (size_t i = 0; i < t.code.size(); i++) {
+    for (size_t w = 0; w < t.code[i].size(); w++) {
+      src.program[src.programSize++] = t.code[i][w];
+    }
+  }
+
+  src.constantCount = t.constants.size();
+  for (size_t i = 0; i < t.constants.size(); i++) {
+    src.constants[i] = t.constants[i];
+  }
+
+  src.errors = 0;
+  src.hash = dvm_program_hash(src.program, src.programSize, src.constants, src.constantCount);
+  return src;
+}
+
+//Create a vm in the test case's initial state, using out's memory
+static VM *engine_vm(const TestCase &t, Outcome &out) {
+  VM *v = dvm_vm_create();
+  memcpy(out.memory, t.memory, sizeof(out.memory));
+  dvm_vm_map_memory(*v, out.memory, MEMORY_SIZE);
+  return v;
+}
+
+static void engine_collect(VM *v, Outcome &out) {
+  dvm_vm_get_registers(*v, out.regs);
+  memset(out.stack, 0, sizeof(out.stack));
+  out.stackSize = dvm_vm_get_stack(*v, out.stack, STACK_SIZE);
+}
+
+//The reference - load the program and run it
+static void engine_reference(const TestCase &t, Outcome &out) {
+  ProgramSource *src = new ProgramSource(to_source(t));
+  VM *v = engine_vm(t, out);
+  dvm_vm_load(*v, *src);
+  dvm_vm_set_registers(*v, t.regs);
+
+  capture = &out.output;
+  out.finished = !dvm_run(*v, BUDGET);
+  capture = 0;
+
+  engine_collect(v, out);
+  dvm_vm_destroy(v);
+  delete src;
+}
+
+//Run from a program image, with the pre-resolved symbols
+static void engine_image(const TestCase &t, Outcome &out) {
+  ProgramSource *src = new ProgramSource(to_source(t));
+  ProgramImage *img = dvm_image_create(*src);
+  VM *v = engine_vm(t, out);
+  dvm_vm_load(*v, img);
+  dvm_image_release(img);
+  dvm_vm_set_registers(*v, t.regs);
+
+  capture = &out.output;
+  out.finished = !dvm_run(*v, BUDGET);
+  capture = 0;
+
+  engine_collect(v, out);
+  dvm_vm_destroy(v);
+  delete src;
+}
+
+//Run the budget in small slices, resuming the program after each
+static void engine_sliced(const TestCase &t, Outcome &out) {
+  ProgramSource *src = new ProgramSource(to_source(t));
+  VM *v = engine_vm(t, out);
+  dvm_vm_load(*v, *src);
+  dvm_vm_set_registers(*v, t.regs);
+
+  std::mt19937 rng(t.code.size());
+  unsigned int remaining = BUDGET;
+  bool more = true;
+
+  capture = &out.output;
+  while (more && remaining > 0) {
+    unsigned int slice = 1 + rng() % 37;
+    if (slice > remaining) slice = remaining;
+    more = dvm_run(*v, slice);
+    remaining -= slice;
+  }
+  out.finished = !more;
+  capture = 0;
+
+  engine_collect(v, out);
+  dvm_vm_destroy(v);
+  delete src;
+}
+
+//Record a run and replay it in a fresh vm
+static void engine_replay(const TestCase &t, Outcome &out) {
+  ProgramSource *src = new ProgramSource(to_source(t));
+
+  Outcome *recorded = new Outcome;
+  VM *r = engine_vm(t, *recorded);
+  dvm_vm_load(*r, *src);
+  dvm_vm_set_registers(*r, t.regs);
+
+  capture = &recorded->output;
+  dvm_record_start(*r);
+  dvm_run(*r, BUDGET);
+  DVMRecording *rec = dvm_record_stop(*r);
+  capture = 0;
+
+  VM *v = engine_vm(t, out);
+  memset(out.memory, 0, sizeof(out.memory));
+  dvm_vm_load(*v, *src);
+
+  capture = &out.output;
+  if (!dvm_replay(*v, rec)) {
+    out.output += "<replay failed>";
+  }
+  capture = 0;
+
+  //A run with no budget just tells us if the program is done
+  out.finished = !dvm_run(*v, 0);
+
+  engine_collect(v, out);
+  dvm_recording_free(rec);
+  dvm_vm_destroy(v);
+  dvm_vm_destroy(r);
+  delete recorded;
+  delete src;
+}
+
+//A vm compiled without the checks a well formed program never needs. The
+//generated programs are always well formed, so this must run them the same.
+struct UncheckedConfig : DefaultConfig {
+  static const bool CHECKED = false;
+};
+
+//Loops are traced the first time they jump back, so that as much as possible
+//runs as traces
+struct TracedConfig : DefaultConfig {
+  static const int TRACE_HOT = 1;
+};
+
+//Nothing runs as traces
+struct UntracedConfig : DefaultConfig {
+  static const bool TRACES = false;
+};
+
+//Run in a vm with another config
+template <typename Config>
+static void engine_config(const TestCase &t, Outcome &out) {
+  ProgramSource *src = new ProgramSource(to_source(t));
+  BasicVM<Config> *v = new BasicVM<Config>;
+  dvm_vm_clear(*v);
+  memcpy(out.memory, t.memory, sizeof(out.memory));
+  dvm_vm_map_memory(*v, out.memory, MEMORY_SIZE);
+  dvm_vm_load(*v, *src);
+  dvm_vm_set_registers(*v, t.regs);
+
+  capture = &out.output;
+  out.finished = !dvm_run(*v, BUDGET);
+  capture = 0;
+
+  dvm_vm_get_registers(*v, out.regs);
+  memset(out.stack, 0, sizeof(out.stack));
+  out.stackSize = dvm_vm_get_stack(*v, out.stack, STACK_SIZE);
+  dvm_vm_release(*v);
+  delete v;
+  delete src;
+}
+
+//Run the reference with a kernel set forced for the vector operations. They 
+//all have to give the same bits. If the CPU doesn't support the kernel set, 
+//this is just the reference.
+static void engine_kernels(const char *isa, const TestCase &t, Outcome &out) {
+  dvm_vec_select(isa);
+  engine_reference(t, out);
+  dvm_vec_select(0);
+}
+
+static void engine_scalar(const TestCase &t, Outcome &out) {
+  engine_kernels("scalar", t, out);
+}
+
+static void engine_sse(const TestCase &t, Outcome &out) {
+  engine_kernels("sse", t, out);
+}
+
+static void engine_avx(const TestCase &t, Outcome &out) {
+  engine_kernels("avx", t, out);
+}
+
+//The engines to check. The first one is the reference the others are 
+//compared against.
+static const Engine engines[] = {
+  { "reference", engine_reference },
+  { "image",     engine_image },
+  { "sliced",    engine_sliced },
+  { "replay",    engine_replay },
+  { "unchecked", engine_config<UncheckedConfig> },
+  { "traced",    engine_config<TracedConfig> },
+  { "untraced",  engine_config<UntracedConfig> },
+  { "scalar",    engine_scalar },
+  { "sse",       engine_sse },
+  { "avx",       engine_avx }
+};
+
+static const int engineCount = sizeof(engines) / sizeof(Engine);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool same_outcome(const Outcome &a, const Outcome &b) {
+  return memcmp(&a.regs, &b.regs, sizeof(a.regs)) == 0 &&
+         a.stackSize == b.stackSize &&
+         memcmp(a.stack, b.stack, sizeof(a.stack)) == 0 &&
+         memcmp(a.memory, b.memory, sizeof(a.memory)) == 0 &&
+         a.output == b.output &&
+         a.finished == b.finished;
+}
+
+//Returns true if the engine gives a different result than the reference
+static bool differs(const TestCase &t, const Engine &e) {
+  Outcome *a = new Outcome;
+  Outcome *b = new Outcome;
+  engines[0].run(t, *a);
+  e.run(t, *b);
+  bool result = !same_outcome(*a, *b);
+  delete a;
+  delete b;
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Generating programs
+
+//Pick a random operand, and append its data word (if any) to ins
+static Operand gen_operand(std::mt19937 &rng, TestCase &t, std::vector<short> &ins) {
+  int kind = rng() % 16;
+
+  if (kind == R_SH) {
+    //Mostly small values, so they're usable as addresses and lengths
+    ins.push_back(rng() % 4 ? rng() % MEMORY_SIZE : (short)rng());
+  } else if (kind == R_IN || kind == R_FL) {
+    ProgramConstant c;
+    c.type = kind;
+    if (kind == R_FL) {
+      c.f = ((int)(rng() % 2001) - 1000) / 8.0f;
+    } else {
+      c.i = rng() % 4 ? rng() % MEMORY_SIZE : (int)rng();
+    }
+    if (t.constants.size() >= 256) {
+      kind = R_SH;
+      ins.push_back(0);
+    } else {
+      ins.push_back(t.constants.size());
+      t.constants.push_back(c);
+    }
+  }
+
+  return Operand(kind);
+}
+
+//Pick a symbol. Any byte can be one, including those with nibbles that 
+//would be constant operands in other instructions.
+static int gen_symbol(std::mt19937 &rng) {
+  return rng() % 4 ? rng() % SYMBOLS : rng() % 256;
+}
+
+//Append a counted loop of integer instructions, which can be traced
+static void gen_loop(std::mt19937 &rng, TestCase &t) {
+  static const Instruction ops[] = { INC, DEC, ADD, SUB, MUL, MOV, CMP };
+  int symbol = gen_symbol(rng);
+  std::vector<short> ins;
+
+  t.code.push_back(std::vector<short>(1, (short)(LBL << 8 | symbol)));
+
+  int length = 1 + rng() % 5;
+  for (int i = 0; i < length; i++) {
+    Instruction op = ops[rng() % 7];
+    Operand a = Operand(R_AS + rng() % 8);
+    ins.assign(1, 0);
+    Operand b = rng() % 2 ? Operand(R_AS + rng() % 8) : gen_operand(rng, t, ins);
+    ins[0] = op << 8 | a << 4 | b;
+    t.code.push_back(ins);
+  }
+
+  //Count a register up or down to a limit
+  Operand counter = Operand(R_AS + rng() % 8);
+  bool up = rng() % 2;
+  ins.assign(1, (short)((up ? INC : DEC) << 8 | counter << 4));
+  t.code.push_back(ins);
+
+  ins.assign(1, 0);
+  Operand limit = gen_operand(rng, t, ins);
+  ins[0] = CMP << 8 | counter << 4 | limit;
+  t.code.push_back(ins);
+
+  Instruction branch = Instruction(JL + rng() % (JGE - JL + 1));
+  t.code.push_back(std::vector<short>(1, (short)(branch << 8 | symbol)));
+}
+
+static TestCase generate(std::mt19937 &rng) {
+  TestCase t;
+
+  for (int i = 0; i < 4; i++) {
+    t.regs.int16Reg[i] = rng() % 64;
+    t.regs.int32Reg[i] = rng() % 2 ? (int)(rng() % 2000) - 1000 : (int)rng();
+    t.regs.floatReg[i] = ((int)(rng() % 2001) - 1000) / 4.0f;
+  }
+
+  for (int i = 0; i < MEMORY_SIZE; i++) {
+    t.memory[i] = ((int)(rng() % 201) - 100) / 2.0f;
+  }
+
+  int length = 1 + rng() % MAX_LENGTH;
+  for (int i = 0; i < length; i++) {
+    if (rng() % 16 == 0) {
+      gen_loop(rng, t);
+      continue;
+    }
+
+    Instruction op = Instruction(rng() % (VCOS + 1));
+    std::vector<short> ins(1, (short)(op << 8));
+
+    switch (op) {
+      //These take a symbol instead of operands
+      case FN: case DO: case LBL:
+      case JMP: case JL: case JG: case JE: case JN: case JLE: case JGE:
+        ins[0] |= gen_symbol(rng);
+        break;
+
+      //Call the bound host function most of the time
+      case CALL:
+        ins[0] |= R_SH << 4;
+        ins.push_back(rng() % 4 ? 1 : rng() % 300);
+        break;
+
+      default: {
+        Operand a = gen_operand(rng, t, ins);
+        Operand b = gen_operand(rng, t, ins);
+        ins[0] |= a << 4 | b;
+        break;
+      }
+    }
+
+    t.code.push_back(ins);
+  }
+
+  return t;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Remove instructions from a failing test case for as long as it keeps 
+//failing. Starts with large chunks and works down to single instructions.
+static TestCase minimize(const TestCase &t, const Engine &e) {
+  TestCase cur = t;
+  bool progress = true;
+
+  while (progress) {
+    progress = false;
+    for (size_t chunk = cur.code.size() / 2; chunk >= 1; chunk /= 2) {
+      size_t i = 0;
+      while (i + chunk <= cur.code.size()) {
+        TestCase c = cur;
+        c.code.erase(c.code.begin() + i, c.code.begin() + i + chunk);
+        if (differs(c, e)) {
+          cur = c;
+          progress = true;
+        } else {
+          i += chunk;
+        }
+      }
+    }
+  }
+
+  return cur;
+}
+
+static void print_outcome(const char *name, const Outcome &o) {
+  std::string output = o.output.size() > 200 ? o.output.substr(0, 200) + "..." : o.output;
+  printf("  %s: finished=%i stack=%i output='%s'\n", name, o.finished, o.stackSize, output.c_str());
+  printf("    as..ds %i %i %i %i  ii..li %i %i %i %i  xf..wf %g %g %g %g\n",
+    o.regs.int16Reg[0], o.regs.int16Reg[1], o.regs.int16Reg[2], o.regs.int16Reg[3],
+    o.regs.int32Reg[0], o.regs.int32Reg[1], o.regs.int32Reg[2], o.regs.int32Reg[3],
+    o.regs.floatReg[0], o.regs.floatReg[1], o.regs.floatReg[2], o.regs.floatReg[3]);
+}
+
+static void print_case(const TestCase &t, const Engine &e) {
+  printf("program[] = {\n");
+  for (size_t i = 0; i < t.code.size(); i++) {
+    printf("  ");
+    for (size_t w = 0; w < t.code[i].size(); w++) {
+      printf("0x%04X ", (unsigned short)t.code[i][w]);
+    }
+    printf(" ;op %i\n", (t.code[i][0] >> 8) & 0xFF);
+  }
+  printf("}\nconstants[] = {\n");
+  for (size_t i = 0; i < t.constants.size(); i++) {
+    if (t.constants[i].type == R_FL) {
+      printf("  %i: float %g\n", (int)i, t.constants[i].f);
+    } else {
+      printf("  %i: int %i\n", (int)i, t.constants[i].i);
+    }
+  }
+  printf("}\n");
+
+  Outcome *a = new Outcome;
+  Outcome *b = new Outcome;
+  engines[0].run(t, *a);
+  e.run(t, *b);
+  print_outcome(engines[0].name, *a);
+  print_outcome(e.name, *b);
+  delete a;
+  delete b;
+}
+
+int main(int argc, const char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+  unsigned int seed = argc > 2 ? strtoul(argv[2], 0, 10) : std::random_device()();
+
+  dvm_set_output(capture_output);
+  dvm_include(1, host_fn);
+
+  printf("Fuzzing %i engines, %i iterations, seed %u\n", engineCount, iterations, seed);
+
+  std::mt19937 rng(seed);
+  int failures = 0;
+
+  for (int i = 0; i < iterations; i++) {
+    TestCase t = generate(rng);
+
+    for (int e = 1; e < engineCount; e++) {
+      if (differs(t, engines[e])) {
+        printf("\nEngine '%s' differs from '%s' in iteration %i:\n", engines[e].name, engines[0].name, i);
+        print_case(minimize(t, engines[e]), engines[e]);
+        failures++;
+      }
+    }
+  }
+
+  printf("%i failures\n", failures);
+  return failures > 0 ? 1 : 0;
+}
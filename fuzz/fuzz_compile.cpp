@@ -0,0 +1,64 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+//libFuzzer target for the compiler. The input is compiled as DVM assembly,
+//and the result is turned into an image and run under an instruction budget.
+//
+//Build:
+//  clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined -Isrc src/*.cpp fuzz/fuzz_compile.cpp -o fuzz_compile -pthread
+//
+//examples/ makes a good seed corpus.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../src/dvm.h"
+
+#define BUDGET 10000
+
+static void discard_output(const char *) {
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  dvm_set_output(discard_output);
+
+  ProgramSource *src = new ProgramSource(dvm_compile_source((const char*)data, size));
+
+  ProgramImage *img = dvm_image_create(*src);
+  if (img) {
+    VM *v = dvm_vm_create();
+    dvm_vm_load(*v, img);
+    dvm_image_release(img);
+    dvm_run(*v, BUDGET);
+    dvm_vm_destroy(v);
+  }
+
+  delete src;
+  return 0;
+}
@@ -0,0 +1,75 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+//libFuzzer target for the bytecode loaders. The first byte of the input 
+//picks the loader: odd means the rest is raw bytecode, even means it's a 
+//program image. Whatever loads is run under an instruction budget.
+//
+//Build:
+//  clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined -Isrc src/*.cpp fuzz/fuzz_loader.cpp -o fuzz_loader -pthread
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "../src/dvm.h"
+
+#define BUDGET 10000
+
+static void discard_output(const char *) {
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size < 1) {
+    return 0;
+  }
+
+  dvm_set_output(discard_output);
+
+  VM *v = dvm_vm_create();
+
+  if (data[0] & 1) {
+    std::vector<short> prog((size - 1) / sizeof(short) + 1);
+    memcpy(&prog[0], data + 1, size - 1);
+    dvm_vm_load(*v, &prog[0], (size - 1) / sizeof(short));
+    dvm_run(*v, BUDGET);
+  } else {
+    ProgramImage *img = dvm_image_load(data + 1, size - 1);
+    if (img) {
+      dvm_vm_load(*v, img);
+      dvm_image_release(img);
+      dvm_run(*v, BUDGET);
+    }
+  }
+
+  dvm_vm_destroy(v);
+  return 0;
+}
@@ -28,13 +28,26 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *******************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <algorithm>
-#include <sstream>
 #include <vector>
 
 #include "dvm.h"
 #include "types.h"
+#include "image.h"
+
+#define MAX_PROGRAM_WORDS 1024
+#define MAX_SYMBOLS       256
+#define MAX_CONSTANTS     256
+
+//If enabled, the compiler will log everything it does to stdout
+#ifdef COMPILER_LOG
+#   define DEBUG_CLOG(x) printf x
+#else
+#   define DEBUG_CLOG(x) do {} while (0)
+#endif
 
 //Convert the name of an instruction to its number
 Instruction ins_name_to_num(std::string str) {
@@ -70,6 +83,16 @@ Instruction ins_name_to_num(std::string str) {
   if (str == "ARG")    return ARG;
   if (str == "PRINT")  return PRINT;
   if (str == "PRINTL") return PRINTL;
+  if (str == "LOAD")   return LOAD;
+  if (str == "STORE")  return STORE;
+  if (str == "VLEN")   return VLEN;
+  if (str == "VADD")   return VADD;
+  if (str == "VMUL")   return VMUL;
+  if (str == "VSCALE") return VSCALE;
+  if (str == "VDOT")   return VDOT;
+  if (str == "VSUM")   return VSUM;
+  if (str == "VSIN")   return VSIN;
+  if (str == "VCOS")   return VCOS;
 
   return NOP;
 }
@@ -102,15 +125,25 @@ Operand reg_name_to_num(std::string str) {
 }
 
 typedef struct Program {
-  short program[1024];
+  short program[MAX_PROGRAM_WORDS];
   int programSize;
 
-  std::string symMap[256];
+  std::string symMap[MAX_SYMBOLS];
   int symCount;
 
+  ProgramConstant constants[MAX_CONSTANTS];
+  int constantCount;
+
+  //The source line of each word in program
+  unsigned short lines[MAX_PROGRAM_WORDS];
+
+  int errors;
+
   Program() {
     programSize = -1;
     symCount = 0;
+    constantCount = 0;
+    errors = 0;
   }
 
 } Program;
@@ -130,32 +163,95 @@ int sym_get_or_create(Program &p, const std::string& str) {
   int index = sym_find(p, str);
 
   if (index == -1) {
+    if (p.symCount >= MAX_SYMBOLS) {
+      printf("ERROR: Too many symbols\n");
+      p.errors++;
+      return 0;
+    }
+
     index = p.symCount;
     p.symMap[index] = str;
     p.symCount++;
   }
 
-  printf("Assigned symbol '%s' -> %i\n", str.c_str(), index);
+  DEBUG_CLOG(("Assigned symbol '%s' -> %i\n", str.c_str(), index));
 
   return index;
 }
 
+//Returns the index of a constant in the constant pool. Adds it if it's not
+//already there.
+int const_get_or_create(Program &p, const ProgramConstant &c) {
+  for (int i = 0; i < p.constantCount; i++) {
+    if (p.constants[i].type == c.type && p.constants[i].i == c.i) {
+      return i;
+    }
+  }
+
+  if (p.constantCount >= MAX_CONSTANTS) {
+    printf("ERROR: Too many constants\n");
+    p.errors++;
+    return 0;
+  }
+
+  p.constants[p.constantCount] = c;
+
+  DEBUG_CLOG(("Assigned constant %i -> %i\n", c.i, p.constantCount));
+
+  return p.constantCount++;
+}
+
+//True if an instruction writes the value of its right operand (or a value
+//computed from it) to the register on the left
+bool writes_left(Instruction op) {
+  switch (op) {
+    case MOV: case ADD: case SUB: case MUL: case DIV: case INC: case DEC: case POP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+//Figure out the type of a literal. If there's a destination register, 
+//the literal takes the type of its register class. Otherwise it's picked
+//based on the literal itself.
+Operand literal_type(Operand dest, const std::string &lit) {
+  if (dest >= R_AS && dest <= R_DS) return R_SH;
+  if (dest >= R_II && dest <= R_LI) return R_IN;
+  if (dest >= R_XF && dest <= R_WF) return R_FL;
+
+  if (lit.find_first_of(".eE") != std::string::npos) {
+    return R_FL;
+  }
+
+  long num = strtol(lit.c_str(), 0, 0);
+  return num >= -32768 && num <= 32767 ? R_SH : R_IN;
+}
+
 //Parse a single tokenized line
 void parse_line(Program &p, std::vector<std::string> &l) {
-  printf("Found %i tokens on line: \n", l.size());
+  DEBUG_CLOG(("Found %i tokens on line: \n", (int)l.size()));
   for (int i = 0; i < l.size(); i++) {
-    printf("    %s\n", l[i].c_str());
+    DEBUG_CLOG(("    %s\n", l[i].c_str()));
+  }
+
+  //An instruction is at most three words - the instruction itself, and
+  //the data for two constant operands
+  if (p.programSize + 3 >= MAX_PROGRAM_WORDS) {
+    printf("ERROR: Program is too large\n");
+    p.errors++;
+    return;
   }
 
   //Check if we're dealing with a label definition
   if (l[0][l[0].size() - 1] == ':') {
     std::string label = l[0].substr(0, l[0].size() - 1);
     int index = sym_get_or_create(p, label);
-    p.program[++p.programSize] = LBL << 8 | (char)index;
+    p.program[++p.programSize] = LBL << 8 | (unsigned char)index;
     return;
   }
 
-  if (l[0] == "symbol") {
+  if (l[0] == "symbol" && l.size() > 1) {
     sym_get_or_create(p, l[1]);
     return;
   }
@@ -163,72 +259,114 @@ void parse_line(Program &p, std::vector<std::string> &l) {
   Instruction op = ins_name_to_num(l[0]);
 
   if (op == NOP) {
+    //Anything that isn't an instruction is also NOP
+    std::string name = l[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (name != "NOP") {
+      printf("ERROR: Unknown instruction '%s'\n", l[0].c_str());
+      p.errors++;
+    }
     return;
   }
 
-  p.program[++p.programSize] = (op << 8);
+  int insIndex = ++p.programSize;
+  p.program[insIndex] = (op << 8);
   
-  printf("Instruction: %X\n", p.program[p.programSize]);
+  DEBUG_CLOG(("Instruction: %X\n", p.program[insIndex]));
+
+  //The destination register decides the type of literals, for the 
+  //instructions that have one. Anything else (comparing, printing, pushing,
+  //and LOAD, whose literal is an address) types literals by their value.
+  Operand dest = R_NONE;
 
   //Now we need to figure out what kind of arguments we're dealing with
-  for (int i = 1; i < l.size(); i++) {
+  for (int i = 1; i < l.size() && i < 3; i++) {
     //Is it a register?
     Operand r = reg_name_to_num(l[i]);
     if (r != R_NONE) {
-      p.program[p.programSize] |= (char)r << (i == 1 ? 4 : 0);
+      p.program[insIndex] |= (char)r << (i == 1 ? 4 : 0);
+      if (i == 1 && writes_left(op)) {
+        dest = r;
+      }
     } else {
 
       //Is it a number?
       if (l[i][0] == '#') {
-        //TODO: We need to figure out which type to use based on the previous register
-        std::stringstream ss(l[i].substr(1));
-        short num = 0;
-        ss >> num ;
-
-        p.program[p.programSize] |= (char)R_SH << (i == 1 ? 4 : 0);
-        p.program[++p.programSize] = num;
+        std::string lit = l[i].substr(1);
+        Operand type = literal_type(dest, lit);
+
+        p.program[insIndex] |= (char)type << (i == 1 ? 4 : 0);
+
+        if (type == R_SH) {
+          //Shorts are stored inline
+          p.program[++p.programSize] = (short)strtol(lit.c_str(), 0, 0);
+        } else {
+          //Ints and floats go in the constant pool
+          ProgramConstant c;
+          c.type = type;
+          if (type == R_FL) {
+            c.f = strtof(lit.c_str(), 0);
+          } else {
+            c.i = (int)strtol(lit.c_str(), 0, 0);
+          }
+          p.program[++p.programSize] = const_get_or_create(p, c);
+        }
 
       } else {
         //Assume it's a symbol.
-        p.program[p.programSize] |= (char)sym_get_or_create(p, l[i]);
+        p.program[insIndex] |= (unsigned char)sym_get_or_create(p, l[i]);
       }
     }
   }
 }
 
-//Opens a file and parses and compiles it to bytecodes
-ProgramSource dvm_compile(const char* filename) {
+//Parse a line, and note which source line the words it adds came from
+void compile_line(Program &p, std::vector<std::string> &l, int lineNumber) {
+  int start = p.programSize + 1;
+  parse_line(p, l);
+  for (int i = start; i <= p.programSize; i++) {
+    p.lines[i] = lineNumber;
+  }
+}
+
+//Parses and compiles a program held in memory to bytecodes
+ProgramSource dvm_compile_source(const char *source, unsigned int size) {
   ProgramSource src;
   src.programSize = 0;
-  
-  FILE *f = fopen(filename, "r");
-  if (!f) {
-    return src;
-  }
+  src.constantCount = 0;
+  src.errors = 0;
+  memset(src.lines, 0, sizeof(src.lines));
+  memset(src.symbolNames, 0, sizeof(src.symbolNames));
 
   Program prog;
+  int lineNumber = 1;
   
-  char c;
   bool inString = false;
+  bool inComment = false;
 
   std::vector<std::string> line;
   std::string token;
 
-  while(fread(&c, 1, 1, f)) {
+  for (unsigned int i = 0; i < size; i++) {
+    char c = source[i];
+
+    //Comments run until the end of the line
+    if (inComment && c != '\n') {
+      continue;
+    }
+    inComment = false;
+
     if (c == '\n' || c == ';') {
       if (token.size() > 0) {
         line.push_back(token);
       }
       if (line.size() > 0) {
-        parse_line(prog, line);
+        compile_line(prog, line, lineNumber);
       }
       token = "";
       line.clear();
-      if (c == ';') {
-        while(c != '\n') {
-          fread(&c, 1, 1, f);
-        }
-      }
+      inComment = c == ';';
+      lineNumber += c == '\n';
     } else if (c == '"') {  
       inString = !inString;
       token += c;
@@ -245,23 +383,66 @@ ProgramSource dvm_compile(const char* filename) {
   }
 
   if (line.size() > 0) {
-    parse_line(prog, line);
+    compile_line(prog, line, lineNumber);
   }
 
-  printf("Compilation done. Result is %i bytes.\n", sizeof(short) * prog.programSize);
-  printf("int program[] = {\n");
+  DEBUG_CLOG(("Compilation done. Result is %i bytes.\n", (int)(sizeof(short) * (prog.programSize + 1))));
+  DEBUG_CLOG(("int program[] = {\n"));
   for (int i = 0; i <= prog.programSize; i++) {
-    if (i > 0) printf(",");
-    printf("\n");
-    printf("  0x%X", prog.program[i]);
+    if (i > 0) DEBUG_CLOG((","));
+    DEBUG_CLOG(("\n"));
+    DEBUG_CLOG(("  0x%X", prog.program[i]));
   }
-  printf("\n}\n");
-
-  fclose(f);
+  DEBUG_CLOG(("\n}\n"));
+  DEBUG_CLOG(("constants[] = {\n"));
+  for (int i = 0; i < prog.constantCount; i++) {
+    if (prog.constants[i].type == R_FL) {
+      DEBUG_CLOG(("  %i: float %f\n", i, prog.constants[i].f));
+    } else {
+      DEBUG_CLOG(("  %i: int %i\n", i, prog.constants[i].i));
+    }
+  }
+  DEBUG_CLOG(("}\n"));
 
   memcpy(&src.program, &prog.program, sizeof(short) * (prog.programSize + 1));
 
   src.programSize = prog.programSize + 1;
 
+  memcpy(&src.constants, &prog.constants, sizeof(ProgramConstant) * prog.constantCount);
+  src.constantCount = prog.constantCount;
+  src.errors = prog.errors;
+  src.hash = dvm_program_hash(src.program, src.programSize, src.constants, src.constantCount);
+
+  memcpy(&src.lines, &prog.lines, sizeof(unsigned short) * (prog.programSize + 1));
+  for (int i = 0; i < prog.symCount; i++) {
+    strncpy(src.symbolNames[i], prog.symMap[i].c_str(), sizeof(src.symbolNames[i]) - 1);
+  }
+
   return src;
-}
\ No newline at end of file
+}
+
+//Opens a file and parses and compiles it to bytecodes
+ProgramSource dvm_compile(const char* filename) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    ProgramSource src;
+    src.programSize = 0;
+    src.constantCount = 0;
+    src.errors = 1;
+    src.hash = dvm_program_hash(src.program, 0, src.constants, 0);
+    memset(src.lines, 0, sizeof(src.lines));
+    memset(src.symbolNames, 0, sizeof(src.symbolNames));
+    return src;
+  }
+
+  std::string source;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    source.append(buffer, n);
+  }
+
+  fclose(f);
+
+  return dvm_compile_source(source.data(), source.size());
+}
@@ -30,15 +30,113 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef h__dvm__
 #define h__dvm__
 
+	//An entry in the constant pool of a program
+	struct ProgramConstant {
+		unsigned char type; //R_IN or R_FL
+		union {
+			int i;
+			float f;
+		};
+	};
+
 	struct ProgramSource {
 		short program[2048];
 		int programSize;
+
+		//Int and float literals are stored here, and referenced by index
+		//in the bytecode
+		ProgramConstant constants[256];
+		int constantCount;
+
+		//Identifies the program and its constants in the metrics, the
+		//profiler and recordings. Set by the compiler, so that loading the
+		//program doesn't need to read it.
+		unsigned int hash;
+
+		//The number of errors found while compiling (unknown instructions,
+		//too many symbols or constants, or a program that's too large).
+		//The program is incomplete if this isn't 0.
+		int errors;
+
+		//The source line each word of the program was compiled from, and
+		//the names of the labels and functions by symbol. Used to map
+		//profiles back to the source.
+		unsigned short lines[2048];
+		char symbolNames[256][32];
+	};
+
+	typedef void (*DVMFN)(double *stack, int size);
+	typedef void (*DVMOUTFN)(const char *text);
+
+	//The registers of a vm, for hosts that need to read or set them
+	struct DVMRegisters {
+		short int16Reg[4]; //as, bs, cs, ds
+		int int32Reg[4];   //ii, ji, ki, li
+		float floatReg[4]; //xf, yf, zf, wf
 	};
 
-	typedef void (*DVMFN)(int *stack, int size);
+	//A log of what a run got from outside of the vm, for replaying it
+	struct DVMRecording;
+
+	//The state of a virtual machine
+	struct VM;
+
+	//A read-only program image that can be mapped from a file and shared
+	struct ProgramImage;
 
 	extern void dvm_run(const short *prog, unsigned int size);
+	extern void dvm_run(const ProgramSource &src);
+	extern void dvm_run(ProgramImage *img);
 	extern ProgramSource dvm_compile(const char* filename);
+	extern ProgramSource dvm_compile_source(const char *source, unsigned int size);
 	extern void dvm_include(unsigned char id, DVMFN fn);
+	extern void dvm_set_output(DVMOUTFN fn);
+
+	extern VM *dvm_vm_create();
+	extern void dvm_vm_destroy(VM *v);
+	extern void dvm_vm_load(VM &v, const short *prog, unsigned int size);
+	extern void dvm_vm_load(VM &v, const ProgramSource &src);
+	//The vm uses the source in place, so it can't be a temporary
+	void dvm_vm_load(VM &v, ProgramSource &&src) = delete;
+	extern void dvm_vm_load(VM &v, ProgramImage *img);
+	extern void dvm_vm_map_memory(VM &v, float *buffer, unsigned int size);
+	extern void dvm_run(VM &v);
+	extern bool dvm_run(VM &v, unsigned int budget);
+	extern void dvm_vm_get_registers(VM &v, DVMRegisters &regs);
+	extern void dvm_vm_set_registers(VM &v, const DVMRegisters &regs);
+	extern int dvm_vm_get_stack(VM &v, double *out, int max);
+
+	extern void dvm_record_start(VM &v);
+	extern DVMRecording *dvm_record_stop(VM &v);
+	extern bool dvm_replay(VM &v, DVMRecording *r);
+	extern bool dvm_recording_save(const DVMRecording *r, const char *filename);
+	extern DVMRecording *dvm_recording_load(const char *filename);
+	extern void dvm_recording_free(DVMRecording *r);
+
+	extern void dvm_metrics_name(VM &v, const char *name);
+	extern void dvm_metrics_export(DVMOUTFN fn);
+	extern bool dvm_metrics_write(const char *filename);
+	extern void dvm_metrics_reset();
+
+	extern bool dvm_profile_start(int hz);
+	extern void dvm_profile_stop();
+	extern void dvm_profile_report(DVMOUTFN fn);
+	extern void dvm_profile_reset();
+
+	extern ProgramImage *dvm_image_create(const ProgramSource &src);
+	extern bool dvm_image_save(const ProgramImage *img, const char *filename);
+	extern ProgramImage *dvm_image_map(const char *filename);
+	extern ProgramImage *dvm_image_load(const void *data, unsigned int size);
+	extern void dvm_image_retain(ProgramImage *img);
+	extern void dvm_image_release(ProgramImage *img);
+
+	//A script that is recompiled when its file changes
+	struct DVMScript;
+
+	extern DVMScript *dvm_script_open(const char *filename);
+	extern void dvm_script_close(DVMScript *s);
+	extern bool dvm_script_poll(DVMScript *s);
+	extern void dvm_script_watch(DVMScript *s, int intervalMs);
+	extern ProgramImage *dvm_script_acquire(DVMScript *s);
 
 #endif
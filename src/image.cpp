@@ -0,0 +1,331 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#ifndef _WIN32
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+#include "dvm.h"
+#include "types.h"
+#include "image.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Round up to the nearest multiple of four
+static unsigned int align4(unsigned int n) {
+  return (n + 3) & ~3u;
+}
+
+//Check that a range of the image is within bounds
+static bool image_range(const ImageHeader *h, unsigned int offset, unsigned int count, unsigned int elementSize) {
+  return (unsigned long long)offset + (unsigned long long)count * elementSize <= h->imageSize;
+}
+
+//Make sure that an image is something we can run. Images may come from
+//anywhere, so nothing in the header is trusted.
+static bool image_valid(const ImageHeader *h, unsigned int size) {
+  if (size < sizeof(ImageHeader)) return false;
+  if (memcmp(h->magic, IMAGE_MAGIC, 4) != 0) return false;
+  if (h->version != IMAGE_VERSION || h->imageSize != size) return false;
+
+  if (h->programOffset % 2 || h->constantOffset % 4 || h->symbolOffset % 2) return false;
+  if (h->programSize >= IMAGE_NO_SYMBOL || h->constantCount > 256) return false;
+
+  if (!image_range(h, h->programOffset, h->programSize, sizeof(short)) ||
+      !image_range(h, h->constantOffset, h->constantCount, sizeof(ProgramConstant)) ||
+      !image_range(h, h->symbolOffset, IMAGE_SYMBOLS, sizeof(short))) {
+    return false;
+  }
+
+  const ProgramConstant *constants = (const ProgramConstant*)((const char*)h + h->constantOffset);
+  for (unsigned int i = 0; i < h->constantCount; i++) {
+    if (constants[i].type != R_IN && constants[i].type != R_FL) {
+      return false;
+    }
+  }
+
+  //Every jump target must be inside the program, or not defined at all
+  const short *symbols = (const short*)((const char*)h + h->symbolOffset);
+  for (int i = 0; i < IMAGE_SYMBOLS; i++) {
+    if (symbols[i] != IMAGE_NO_SYMBOL && (symbols[i] < 0 || symbols[i] >= (int)h->programSize)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Find the location of all the labels and functions in a program. 
+//This decodes the program the same way the VM does, so that data words
+//following an instruction are never mistaken for labels.
+void dvm_resolve_symbols(const short *prog, int size, short *symbols) {
+  for (int i = 0; i < IMAGE_SYMBOLS; i++) {
+    symbols[i] = IMAGE_NO_SYMBOL;
+  }
+
+  int cursor = 0;
+  while (cursor < size) {
+    short c = prog[cursor];
+    Instruction ins = Instruction((c & 0xFF00) >> 8);
+
+    if (ins == LBL || ins == FN) {
+      symbols[c & 0x00FF] = cursor;
+    }
+
+    //Skip the data words of constant operands
+    cursor += ins_data_words(c) + 1;
+  }
+}
+
+//Hash some data into h (FNV-1a)
+unsigned int dvm_hash_data(const void *data, size_t size, unsigned int h) {
+  const unsigned char *p = (const unsigned char*)data;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+unsigned int dvm_program_hash(const short *prog, int size, const ProgramConstant *constants, int constantCount) {
+  unsigned int h = dvm_hash_data(prog, sizeof(short) * size);
+  for (int i = 0; i < constantCount; i++) {
+    //The padding after the type isn't hashed
+    h = dvm_hash_data(&constants[i].type, 1, h);
+    h = dvm_hash_data(&constants[i].i, sizeof(int), h);
+  }
+  return h;
+}
+
+//Check that a program is well formed: every data word an instruction reads
+//is inside the program, and every constant it refers to is in the pool.
+bool dvm_verify_program(const short *prog, int size, int constantCount) {
+  int cursor = 0;
+  while (cursor < size) {
+    short c = prog[cursor];
+    int operands[2] = {(c & 0x00F0) >> 4, c & 0x000F};
+
+    //Symbols take the place of the operands
+    if (ins_has_symbol(Instruction((c & 0xFF00) >> 8))) {
+      operands[0] = operands[1] = R_NONE;
+    }
+
+    for (int i = 0; i < 2; i++) {
+      if (operands[i] < R_SH) continue;
+
+      cursor++;
+      if (cursor >= size) {
+        return false;
+      }
+      if (operands[i] != R_SH && (unsigned short)prog[cursor] >= constantCount) {
+        return false;
+      }
+    }
+
+    cursor++;
+  }
+  return true;
+}
+
+//Build an image of a compiled program on the heap
+ProgramImage *dvm_image_create(const ProgramSource &src) {
+  unsigned int programOffset = sizeof(ImageHeader);
+  unsigned int constantOffset = align4(programOffset + sizeof(short) * src.programSize);
+  unsigned int symbolOffset = constantOffset + sizeof(ProgramConstant) * src.constantCount;
+  unsigned int size = symbolOffset + sizeof(short) * IMAGE_SYMBOLS;
+
+  char *data = (char*)calloc(1, size);
+  if (!data) {
+    return 0;
+  }
+
+  ImageHeader *h = (ImageHeader*)data;
+  memcpy(h->magic, IMAGE_MAGIC, 4);
+  h->version = IMAGE_VERSION;
+  h->imageSize = size;
+  h->programOffset = programOffset;
+  h->programSize = src.programSize;
+  h->constantOffset = constantOffset;
+  h->constantCount = src.constantCount;
+  h->symbolOffset = symbolOffset;
+  h->programHash = dvm_program_hash(src.program, src.programSize, src.constants, src.constantCount);
+
+  memcpy(data + programOffset, src.program, sizeof(short) * src.programSize);
+
+  memcpy(data + constantOffset, src.constants, sizeof(ProgramConstant) * src.constantCount);
+
+  dvm_resolve_symbols(src.program, src.programSize, (short*)(data + symbolOffset));
+
+  ProgramImage *img = new ProgramImage;
+  img->header = h;
+  img->mapped = false;
+  img->refs = 1;
+  return img;
+}
+
+//Write an image to a file so that it can be mapped later on. The file is
+//replaced rather than rewritten, so processes that have the old one mapped 
+//keep running it.
+bool dvm_image_save(const ProgramImage *img, const char *filename) {
+  std::string temp = std::string(filename) + ".tmp";
+
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+
+  bool ok = fwrite(img->header, img->header->imageSize, 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+
+  if (!ok || rename(temp.c_str(), filename) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+//Map an image file into memory. The pages are mapped read-only and shared,
+//so all the processes mapping the same file use the same physical memory.
+ProgramImage *dvm_image_map(const char *filename) {
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ImageHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+
+  if (!image_valid((const ImageHeader*)data, st.st_size)) {
+    munmap(data, st.st_size);
+    return 0;
+  }
+
+  ProgramImage *img = new ProgramImage;
+  img->header = (const ImageHeader*)data;
+  img->mapped = true;
+  img->refs = 1;
+  return img;
+#else
+  //No mmap here, so fall back to reading the file into private memory
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return 0;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  char *data = size >= (long)sizeof(ImageHeader) ? (char*)malloc(size) : 0;
+  if (!data || fread(data, size, 1, f) != 1 || !image_valid((const ImageHeader*)data, size)) {
+    free(data);
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+
+  ProgramImage *img = new ProgramImage;
+  img->header = (const ImageHeader*)data;
+  img->mapped = false;
+  img->refs = 1;
+  return img;
+#endif
+}
+
+//Load an image from memory, e.g. one embedded in the executable. The data
+//is copied, so it doesn't need to stay around.
+ProgramImage *dvm_image_load(const void *data, unsigned int size) {
+  if (size < sizeof(ImageHeader)) {
+    return 0;
+  }
+
+  char *copy = (char*)malloc(size);
+  if (!copy) {
+    return 0;
+  }
+  memcpy(copy, data, size);
+
+  if (!image_valid((const ImageHeader*)copy, size)) {
+    free(copy);
+    return 0;
+  }
+
+  ProgramImage *img = new ProgramImage;
+  img->header = (const ImageHeader*)copy;
+  img->mapped = false;
+  img->refs = 1;
+  return img;
+}
+
+//Add a reference to an image
+void dvm_image_retain(ProgramImage *img) {
+  if (img) {
+    img->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+//Drop a reference to an image. The image is unmapped (or freed) when the 
+//last reference is dropped.
+void dvm_image_release(ProgramImage *img) {
+  if (!img || img->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+
+#ifndef _WIN32
+  if (img->mapped) {
+    munmap((void*)img->header, img->header->imageSize);
+  } else {
+    free((void*)img->header);
+  }
+#else
+  free((void*)img->header);
+#endif
+
+  delete img;
+}
@@ -0,0 +1,116 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_image__
+#define h__dvm_image__
+
+#include <atomic>
+
+#include "dvm.h"
+#include "types.h"
+
+//Program images are laid out so that they can be mapped straight from a file
+//and shared, read-only, by any number of processes and VMs:
+//
+//  ImageHeader
+//  short program[programSize]       The bytecode
+//  ProgramConstant constants[constantCount]   The typed constant pool
+//  short symbols[IMAGE_SYMBOLS]     Resolved jump targets
+//
+//All offsets are in bytes from the start of the image, so nothing in it 
+//depends on where it's mapped. Values are stored in host byte order.
+
+#define IMAGE_MAGIC     "DVMI"
+#define IMAGE_VERSION   3
+
+//One jump target per possible symbol byte
+#define IMAGE_SYMBOLS   256
+
+//Stored for symbols that are never defined. Larger than any program, so 
+//jumps to it are ignored.
+#define IMAGE_NO_SYMBOL 0x7FFF
+
+typedef struct ImageHeader {
+  char magic[4];
+  unsigned int version;
+  unsigned int imageSize;
+
+  unsigned int programOffset;
+  unsigned int programSize;
+
+  unsigned int constantOffset;
+  unsigned int constantCount;
+
+  unsigned int symbolOffset;
+
+  //See dvm_program_hash
+  unsigned int programHash;
+} ImageHeader;
+
+struct ProgramImage {
+  const ImageHeader *header;
+  //True if the image is mapped from a file, false if it's on the heap
+  bool mapped;
+  //The image is released when the last reference is dropped
+  std::atomic<int> refs;
+};
+
+inline const short *image_program(const ProgramImage *img) {
+  return (const short*)((const char*)img->header + img->header->programOffset);
+}
+
+inline const ProgramConstant *image_constants(const ProgramImage *img) {
+  return (const ProgramConstant*)((const char*)img->header + img->header->constantOffset);
+}
+
+inline const short *image_symbols(const ProgramImage *img) {
+  return (const short*)((const char*)img->header + img->header->symbolOffset);
+}
+
+//Find the location of all the labels and functions in a program
+extern void dvm_resolve_symbols(const short *prog, int size, short *symbols);
+
+//Hash some data, continuing from h (FNV-1a)
+extern unsigned int dvm_hash_data(const void *data, size_t size, unsigned int h = 2166136261u);
+
+//Hash of a program and its constants, which identifies it in the metrics,
+//the profiler and recordings. Computed when a program is compiled or an 
+//image is made, so loading a program doesn't need to read it.
+extern unsigned int dvm_program_hash(const short *prog, int size, const ProgramConstant *constants, int constantCount);
+
+//Check that a program can be run without checking it as it runs
+extern bool dvm_verify_program(const short *prog, int size, int constantCount);
+
+//Convert a constant pool entry to what the VM computes with
+template <typename Value>
+inline Value dvm_constant_value(const ProgramConstant &c) {
+  return c.type == R_FL ? Value(c.f) : Value(c.i);
+}
+
+#endif
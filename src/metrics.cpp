@@ -0,0 +1,393 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+//Run time metrics, for capacity planning. See metrics.h.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "dvm.h"
+#include "metrics.h"
+
+//Upper bounds of the run latency buckets, in seconds
+static const double runBuckets[] = {
+  0.000001, 0.000005, 0.00001, 0.00005, 0.0001, 0.0005, 
+  0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1
+};
+
+#define RUN_BUCKETS (sizeof(runBuckets) / sizeof(double))
+
+////////////////////////////////////////////////////////////////////////////////
+
+//The metrics of one program
+typedef struct ProgramMetrics {
+  unsigned long long runs;
+  unsigned long long instructions;
+  unsigned long long nanos;
+  //Runs per latency bucket (not cumulative)
+  unsigned long long buckets[RUN_BUCKETS];
+
+  int stackHigh;
+  int stackSize;
+  int callstackHigh;
+  int callstackSize;
+} ProgramMetrics;
+
+//A set of metrics - those of one thread, or the sum of several
+typedef struct MetricsBlock {
+  std::map<unsigned int, ProgramMetrics> programs;
+  unsigned long long hostCalls[METRICS_HOST_FNS];
+  unsigned long long hostNanos[METRICS_HOST_FNS];
+} MetricsBlock;
+
+//The metrics of one thread. Only the thread itself writes to them, so the
+//lock is only ever contended while the metrics are being exported.
+typedef struct ThreadMetrics {
+  std::mutex lock;
+  MetricsBlock block;
+
+  ThreadMetrics();
+  ~ThreadMetrics();
+} ThreadMetrics;
+
+static std::mutex registryLock;
+//The metrics of the running threads
+static std::vector<ThreadMetrics*> threads;
+//The metrics of threads that have exited
+static MetricsBlock retired;
+//Names given to programs by the host
+static std::map<unsigned int, std::string> names;
+
+static void block_clear(MetricsBlock &b) {
+  b.programs.clear();
+  memset(b.hostCalls, 0, sizeof(b.hostCalls));
+  memset(b.hostNanos, 0, sizeof(b.hostNanos));
+}
+
+static void program_merge(ProgramMetrics &into, const ProgramMetrics &from) {
+  into.runs += from.runs;
+  into.instructions += from.instructions;
+  into.nanos += from.nanos;
+  for (size_t i = 0; i < RUN_BUCKETS; i++) {
+    into.buckets[i] += from.buckets[i];
+  }
+  if (from.stackHigh > into.stackHigh) into.stackHigh = from.stackHigh;
+  if (from.stackSize > into.stackSize) into.stackSize = from.stackSize;
+  if (from.callstackHigh > into.callstackHigh) into.callstackHigh = from.callstackHigh;
+  if (from.callstackSize > into.callstackSize) into.callstackSize = from.callstackSize;
+}
+
+static void block_merge(MetricsBlock &into, const MetricsBlock &from) {
+  std::map<unsigned int, ProgramMetrics>::const_iterator it;
+  for (it = from.programs.begin(); it != from.programs.end(); ++it) {
+    std::map<unsigned int, ProgramMetrics>::iterator p = into.programs.find(it->first);
+    if (p == into.programs.end()) {
+      into.programs[it->first] = it->second;
+    } else {
+      program_merge(p->second, it->second);
+    }
+  }
+
+  for (int i = 0; i < METRICS_HOST_FNS; i++) {
+    into.hostCalls[i] += from.hostCalls[i];
+    into.hostNanos[i] += from.hostNanos[i];
+  }
+}
+
+ThreadMetrics::ThreadMetrics() {
+  block_clear(block);
+  std::lock_guard<std::mutex> guard(registryLock);
+  threads.push_back(this);
+}
+
+//Keep what the thread did when it exits
+ThreadMetrics::~ThreadMetrics() {
+  std::lock_guard<std::mutex> guard(registryLock);
+  for (size_t i = 0; i < threads.size(); i++) {
+    if (threads[i] == this) {
+      threads.erase(threads.begin() + i);
+      break;
+    }
+  }
+  block_merge(retired, block);
+}
+
+//The metrics of the calling thread, created the first time they're used
+static ThreadMetrics &thread_metrics() {
+  static thread_local ThreadMetrics metrics;
+  return metrics;
+}
+
+//Add up the metrics of all threads
+static void snapshot(MetricsBlock &total) {
+  std::lock_guard<std::mutex> guard(registryLock);
+  block_clear(total);
+  block_merge(total, retired);
+  for (size_t i = 0; i < threads.size(); i++) {
+    std::lock_guard<std::mutex> thread(threads[i]->lock);
+    block_merge(total, threads[i]->block);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+unsigned long long dvm_metrics_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+void dvm_metrics_flush(RunMetrics &m, unsigned long long instructions, unsigned long long nanos,
+                       unsigned int *hostCalls, unsigned long long *hostNanos) {
+  ThreadMetrics &t = thread_metrics();
+  std::lock_guard<std::mutex> guard(t.lock);
+
+  //New programs start out zeroed
+  ProgramMetrics &p = t.block.programs[m.program];
+  p.runs++;
+  p.instructions += instructions;
+  p.nanos += nanos;
+
+  size_t bucket = 0;
+  while (bucket < RUN_BUCKETS && nanos > runBuckets[bucket] * 1e9) {
+    bucket++;
+  }
+  if (bucket < RUN_BUCKETS) {
+    p.buckets[bucket]++;
+  }
+
+  if (m.stackHigh > p.stackHigh) p.stackHigh = m.stackHigh;
+  if (m.stackSize > p.stackSize) p.stackSize = m.stackSize;
+  if (m.callstackHigh > p.callstackHigh) p.callstackHigh = m.callstackHigh;
+  if (m.callstackSize > p.callstackSize) p.callstackSize = m.callstackSize;
+
+  if (m.hostCalled) {
+    for (int i = 0; i < METRICS_HOST_FNS; i++) {
+      t.block.hostCalls[i] += hostCalls[i];
+      t.block.hostNanos[i] += hostNanos[i];
+    }
+    memset(hostCalls, 0, sizeof(unsigned int) * METRICS_HOST_FNS);
+    memset(hostNanos, 0, sizeof(unsigned long long) * METRICS_HOST_FNS);
+    m.hostCalled = false;
+  }
+}
+
+void dvm_metrics_set_name(unsigned int program, const char *name) {
+  std::lock_guard<std::mutex> guard(registryLock);
+  names[program] = name;
+}
+
+//The name of a program, or its hash. The registry lock must be held.
+static std::string program_name(unsigned int program) {
+  std::map<unsigned int, std::string>::const_iterator it = names.find(program);
+  if (it == names.end()) {
+    char hash[16];
+    snprintf(hash, sizeof(hash), "%08x", program);
+    return hash;
+  }
+  return it->second;
+}
+
+std::string dvm_metrics_program_name(unsigned int program) {
+  std::lock_guard<std::mutex> guard(registryLock);
+  return program_name(program);
+}
+
+//Clear the metrics of all threads
+void dvm_metrics_reset() {
+  std::lock_guard<std::mutex> guard(registryLock);
+  block_clear(retired);
+  for (size_t i = 0; i < threads.size(); i++) {
+    std::lock_guard<std::mutex> thread(threads[i]->lock);
+    block_clear(threads[i]->block);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Prometheus text format
+
+void dvm_appendf(std::string &out, const char *fmt, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, fmt);
+  int size = vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+
+  if (size < (int)sizeof(buffer)) {
+    if (size > 0) out.append(buffer, size);
+    return;
+  }
+
+  //Lines with long names don't fit, so they're formatted again straight 
+  //into the string
+  size_t start = out.size();
+  out.resize(start + size + 1);
+  va_start(args, fmt);
+  vsnprintf(&out[start], size + 1, fmt, args);
+  va_end(args);
+  out.resize(start + size);
+}
+
+static void header(std::string &out, const char *name, const char *type, const char *help) {
+  dvm_appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+//The label value for a program - its name, or its hash
+static std::string program_label(unsigned int program) {
+  std::string name = program_name(program);
+  std::string label;
+  for (size_t i = 0; i < name.size(); i++) {
+    char c = name[i];
+    if (c == '\\' || c == '"') label += '\\';
+    if (c == '\n') {
+      label += "\\n";
+    } else {
+      label += c;
+    }
+  }
+  return label;
+}
+
+//The metrics of each program by label. Programs with the same name (like 
+//every version of a hot reloaded script) are added up, as a label can only 
+//appear once per metric in an export.
+typedef std::map<std::string, ProgramMetrics> LabelledMetrics;
+
+static void label_programs(LabelledMetrics &out, const MetricsBlock &b) {
+  std::map<unsigned int, ProgramMetrics>::const_iterator it;
+  for (it = b.programs.begin(); it != b.programs.end(); ++it) {
+    std::string label = program_label(it->first);
+    LabelledMetrics::iterator p = out.find(label);
+    if (p == out.end()) {
+      out[label] = it->second;
+    } else {
+      program_merge(p->second, it->second);
+    }
+  }
+}
+
+//One line per program for a value picked from its metrics
+static void program_lines(std::string &out, const LabelledMetrics &programs, const char *name, 
+                          unsigned long long (*value)(const ProgramMetrics &p)) {
+  LabelledMetrics::const_iterator it;
+  for (it = programs.begin(); it != programs.end(); ++it) {
+    dvm_appendf(out, "%s{program=\"%s\"} %llu\n", name, it->first.c_str(), value(it->second));
+  }
+}
+
+static unsigned long long runs(const ProgramMetrics &p) { return p.runs; }
+static unsigned long long instructions(const ProgramMetrics &p) { return p.instructions; }
+static unsigned long long stackHigh(const ProgramMetrics &p) { return p.stackHigh; }
+static unsigned long long stackSize(const ProgramMetrics &p) { return p.stackSize; }
+static unsigned long long callstackHigh(const ProgramMetrics &p) { return p.callstackHigh; }
+static unsigned long long callstackSize(const ProgramMetrics &p) { return p.callstackSize; }
+
+static std::string metrics_text() {
+  MetricsBlock *b = new MetricsBlock;
+  snapshot(*b);
+
+  std::lock_guard<std::mutex> guard(registryLock);
+  std::string out;
+  LabelledMetrics programs;
+  label_programs(programs, *b);
+
+  header(out, "dvm_runs_total", "counter", "Calls to dvm_run.");
+  program_lines(out, programs, "dvm_runs_total", runs);
+  header(out, "dvm_instructions_total", "counter", "Instructions executed.");
+  program_lines(out, programs, "dvm_instructions_total", instructions);
+  header(out, "dvm_stack_high_water", "gauge", "The most values that have been on the stack.");
+  program_lines(out, programs, "dvm_stack_high_water", stackHigh);
+  header(out, "dvm_stack_size", "gauge", "The size of the stack.");
+  program_lines(out, programs, "dvm_stack_size", stackSize);
+  header(out, "dvm_do_depth_high_water", "gauge", "The deepest sub routine calls have been nested.");
+  program_lines(out, programs, "dvm_do_depth_high_water", callstackHigh);
+  header(out, "dvm_do_depth_size", "gauge", "The size of the call stack.");
+  program_lines(out, programs, "dvm_do_depth_size", callstackSize);
+
+  header(out, "dvm_run_seconds", "histogram", "How long calls to dvm_run take.");
+  LabelledMetrics::const_iterator it;
+  for (it = programs.begin(); it != programs.end(); ++it) {
+    const std::string &label = it->first;
+    const ProgramMetrics &p = it->second;
+    unsigned long long count = 0;
+    for (size_t i = 0; i < RUN_BUCKETS; i++) {
+      count += p.buckets[i];
+      dvm_appendf(out, "dvm_run_seconds_bucket{program=\"%s\",le=\"%g\"} %llu\n", label.c_str(), runBuckets[i], count);
+    }
+    dvm_appendf(out, "dvm_run_seconds_bucket{program=\"%s\",le=\"+Inf\"} %llu\n", label.c_str(), p.runs);
+    dvm_appendf(out, "dvm_run_seconds_sum{program=\"%s\"} %.9f\n", label.c_str(), p.nanos / 1e9);
+    dvm_appendf(out, "dvm_run_seconds_count{program=\"%s\"} %llu\n", label.c_str(), p.runs);
+  }
+
+  header(out, "dvm_host_calls_total", "counter", "Calls to each host function.");
+  for (int i = 0; i < METRICS_HOST_FNS; i++) {
+    if (b->hostCalls[i]) dvm_appendf(out, "dvm_host_calls_total{id=\"%i\"} %llu\n", i, b->hostCalls[i]);
+  }
+  header(out, "dvm_host_call_seconds_total", "counter", "Time spent in each host function.");
+  for (int i = 0; i < METRICS_HOST_FNS; i++) {
+    if (b->hostCalls[i]) dvm_appendf(out, "dvm_host_call_seconds_total{id=\"%i\"} %.9f\n", i, b->hostNanos[i] / 1e9);
+  }
+
+  delete b;
+  return out;
+}
+
+//Send a snapshot of the metrics, in the Prometheus text format, to fn
+void dvm_metrics_export(DVMOUTFN fn) {
+  std::string text = metrics_text();
+  fn(text.c_str());
+}
+
+//Write a snapshot of the metrics, in the Prometheus text format, to a file.
+//The file is replaced in one go, so a collector never sees half of it.
+bool dvm_metrics_write(const char *filename) {
+  std::string text = metrics_text();
+  std::string temp = std::string(filename) + ".tmp";
+
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+
+  bool ok = text.empty() || fwrite(text.c_str(), text.size(), 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+
+  if (!ok || rename(temp.c_str(), filename) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,78 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_metrics__
+#define h__dvm_metrics__
+
+#include <string>
+
+//Metrics are kept in the vm while it runs, and added to the metrics of the
+//thread it runs on once the run is over, so nothing is shared while a 
+//program is running. Exporting the metrics adds up those of all threads.
+//
+//Everything is kept per program. Programs are told apart by the hash of 
+//their bytecode and constants, unless the host has named them.
+
+//One slot per host function id
+#define METRICS_HOST_FNS 256
+
+//What a vm has done since its metrics were last flushed
+typedef struct RunMetrics {
+  //Identifies the program in the metrics
+  unsigned int program;
+
+  //The highest the stack and call stack have been, and their sizes
+  int stackHigh;
+  int stackSize;
+  int callstackHigh;
+  int callstackSize;
+
+  //Set if any host functions have been called. The calls are counted in 
+  //arrays of METRICS_HOST_FNS entries kept next to this in the vm.
+  bool hostCalled;
+} RunMetrics;
+
+//Monotonic time in nanoseconds
+extern unsigned long long dvm_metrics_now();
+
+//Add what a run did to the metrics of the calling thread. hostCalls and 
+//hostNanos are cleared if m.hostCalled is set.
+extern void dvm_metrics_flush(RunMetrics &m, unsigned long long instructions, unsigned long long nanos,
+                              unsigned int *hostCalls, unsigned long long *hostNanos);
+
+//Name a program in the metrics
+extern void dvm_metrics_set_name(unsigned int program, const char *name);
+
+//Get the name of a program, or its hash in hex if it hasn't been named
+extern std::string dvm_metrics_program_name(unsigned int program);
+
+//Append printf formatted text to out, however long it turns out
+extern void dvm_appendf(std::string &out, const char *fmt, ...);
+
+#endif
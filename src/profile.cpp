@@ -0,0 +1,438 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+//Sampling profiler. See profile.h.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#   include <sys/time.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dvm.h"
+#include "types.h"
+#include "metrics.h"
+#include "profile.h"
+
+//Function keys for code that isn't in a function
+#define PROFILE_MAIN    -1
+#define PROFILE_UNKNOWN -2
+
+//How often the samples are added up, in milliseconds
+#define PROFILE_DRAIN_MS 100
+
+//What a vm was doing when the timer went off
+typedef struct Sample {
+  //0 when free, 1 while the signal handler writes it, 2 when it's ready
+  std::atomic<int> state;
+  unsigned int program;
+  int cursor;
+  int depth;
+  //Where the sub routines on the call stack were called from, innermost
+  //first
+  int frames[PROFILE_FRAMES];
+} Sample;
+
+//What the profiler knows about a program
+typedef struct ProgramInfo {
+  //The source line of each word, or empty if there's no source
+  std::vector<unsigned short> lines;
+  //For each DO, the symbol it calls. -1 for other words.
+  std::vector<short> calls;
+  //Names of the symbols, if there's a source
+  std::vector<std::string> names;
+} ProgramInfo;
+
+//The samples of a program, added up
+typedef struct ProgramProfile {
+  unsigned long long samples;
+  //Samples per source line. Words are used (as -1 - word) if there's no source.
+  std::map<int, unsigned long long> lines;
+  //Samples in each function (by symbol), and in it or anything it calls
+  std::map<int, unsigned long long> fnSelf;
+  std::map<int, unsigned long long> fnTotal;
+} ProgramProfile;
+
+std::atomic<unsigned int> dvm_profile_generation(0);
+
+static Sample samples[PROFILE_SAMPLES];
+static std::atomic<unsigned int> sampleNext(0);
+//Timer ticks, ticks that caught a vm running, and samples lost because 
+//they couldn't be added up fast enough
+static std::atomic<unsigned long long> ticks(0);
+static std::atomic<unsigned long long> taken(0);
+static std::atomic<unsigned long long> dropped(0);
+
+//The slot of the vm running on this thread, if any. The signal handler reads
+//it, so it's initial-exec: a fixed offset from the thread pointer, rather than
+//a call to __tls_get_addr that could allocate inside the handler
+#if defined(__GNUC__)
+#define PROFILE_TLS __attribute__((tls_model("initial-exec")))
+#else
+#define PROFILE_TLS
+#endif
+static thread_local ProfileSlot *volatile currentSlot PROFILE_TLS = 0;
+
+//Guards everything below
+static std::mutex profileLock;
+static std::map<unsigned int, ProgramInfo> programs;
+static std::map<unsigned int, ProgramProfile> profiles;
+static unsigned int lastGeneration = 0;
+
+//running is claimed by whoever starts the profiler and let go once it has 
+//completely stopped, sampling is cleared to stop it
+static std::thread drainer;
+static std::atomic<bool> running(false);
+static std::atomic<bool> sampling(false);
+
+#ifndef _WIN32
+static struct sigaction previousAction;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Runs in the signal handler, so this only touches the slot, the sample 
+//buffer and lock free atomics
+static void profile_signal(int) {
+  int savedErrno = errno;
+  ProfileSlot *slot = currentSlot;
+
+  ticks.fetch_add(1, std::memory_order_relaxed);
+
+  if (slot) {
+    Sample &s = samples[sampleNext.fetch_add(1, std::memory_order_relaxed) % PROFILE_SAMPLES];
+    int expected = 0;
+
+    if (s.state.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+      int depth = *slot->callstackPointer;
+      if (depth < 0) depth = 0;
+      if (depth > slot->callstackSize) depth = slot->callstackSize;
+
+      s.program = slot->program;
+      s.cursor = *slot->cursor;
+      s.depth = depth;
+      for (int i = 0; i < depth && i < PROFILE_FRAMES; i++) {
+        s.frames[i] = slot->callstack[depth - 1 - i];
+      }
+
+      s.state.store(2, std::memory_order_release);
+      taken.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  errno = savedErrno;
+}
+
+ProfileSlot *dvm_profile_enter(ProfileSlot *slot) {
+  ProfileSlot *previous = currentSlot;
+  //The slot must be filled in before the signal handler can see it
+  std::atomic_signal_fence(std::memory_order_release);
+  currentSlot = slot;
+  return previous;
+}
+
+void dvm_profile_leave(ProfileSlot *previous) {
+  currentSlot = previous;
+  std::atomic_signal_fence(std::memory_order_release);
+}
+
+void dvm_profile_program(unsigned int program, const short *prog, int size, const ProgramSource *src) {
+  std::lock_guard<std::mutex> guard(profileLock);
+  if (programs.find(program) != programs.end()) {
+    return;
+  }
+
+  ProgramInfo &info = programs[program];
+  info.calls.assign(size, -1);
+
+  //Decode the program the way the vm does, to find each DO - that's what
+  //ends up on the call stack
+  int cursor = 0;
+  while (cursor < size) {
+    short c = prog[cursor];
+    if (Instruction((c & 0xFF00) >> 8) == DO) {
+      info.calls[cursor] = c & 0x00FF;
+    }
+    cursor += ins_data_words(c) + 1;
+  }
+
+  if (src) {
+    info.lines.assign(src->lines, src->lines + size);
+    info.names.resize(256);
+    for (int i = 0; i < 256; i++) {
+      const char *name = src->symbolNames[i];
+      info.names[i].assign(name, strnlen(name, sizeof(src->symbolNames[i])));
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//The function a sub routine call on the stack went to
+static int callee(const ProgramInfo *info, int frame) {
+  if (!info || frame < 0 || frame >= (int)info->calls.size() || info->calls[frame] < 0) {
+    return PROFILE_UNKNOWN;
+  }
+  return info->calls[frame];
+}
+
+//Add a sample to the profile of its program. Must hold profileLock.
+static void add_sample(const Sample &s) {
+  ProgramProfile &p = profiles[s.program];
+  std::map<unsigned int, ProgramInfo>::const_iterator it = programs.find(s.program);
+  const ProgramInfo *info = it != programs.end() ? &it->second : 0;
+
+  p.samples++;
+
+  if (info && s.cursor >= 0 && s.cursor < (int)info->lines.size()) {
+    p.lines[info->lines[s.cursor]]++;
+  } else {
+    p.lines[-1 - s.cursor]++;
+  }
+
+  //The function we're in is the one the innermost call went to
+  int frames = s.depth < PROFILE_FRAMES ? s.depth : PROFILE_FRAMES;
+  int self = s.depth > 0 ? callee(info, s.frames[0]) : PROFILE_MAIN;
+  p.fnSelf[self]++;
+
+  //Everything on the call stack counts towards the total, but only once
+  //for recursive calls
+  int counted[PROFILE_FRAMES + 1];
+  int countedSize = 0;
+  counted[countedSize++] = PROFILE_MAIN;
+  for (int i = 0; i < frames; i++) {
+    int fn = callee(info, s.frames[i]);
+    if (std::find(counted, counted + countedSize, fn) == counted + countedSize) {
+      counted[countedSize++] = fn;
+    }
+  }
+  for (int i = 0; i < countedSize; i++) {
+    p.fnTotal[counted[i]]++;
+  }
+}
+
+//Add up the samples that are ready
+static void drain() {
+  std::lock_guard<std::mutex> guard(profileLock);
+  for (int i = 0; i < PROFILE_SAMPLES; i++) {
+    if (samples[i].state.load(std::memory_order_acquire) == 2) {
+      add_sample(samples[i]);
+      samples[i].state.store(0, std::memory_order_release);
+    }
+  }
+}
+
+//Start sampling hz times per second of CPU time. Returns false if the
+//profiler is already running (or still stopping), or the signal handler or 
+//timer couldn't be set up.
+bool dvm_profile_start(int hz) {
+#ifndef _WIN32
+  bool expected = false;
+  if (hz <= 0 || !running.compare_exchange_strong(expected, true)) {
+    return false;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profile_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previousAction) != 0) {
+    running = false;
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(profileLock);
+    if (++lastGeneration == 0) ++lastGeneration;
+    dvm_profile_generation = lastGeneration;
+  }
+
+  int interval = hz < 1000000 ? 1000000 / hz : 1;
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, 0) != 0) {
+    //No timer was started, so no signal can be on its way
+    dvm_profile_generation = 0;
+    sigaction(SIGPROF, &previousAction, 0);
+    running = false;
+    return false;
+  }
+
+  sampling = true;
+  drainer = std::thread([]() {
+    while (sampling) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(PROFILE_DRAIN_MS));
+      drain();
+    }
+  });
+  return true;
+#else
+  (void)hz;
+  return false;
+#endif
+}
+
+//Stop sampling. The samples taken so far are kept until reset.
+void dvm_profile_stop() {
+#ifndef _WIN32
+  bool expected = true;
+  if (!sampling.compare_exchange_strong(expected, false)) {
+    return;
+  }
+
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, 0);
+  dvm_profile_generation = 0;
+
+  //A signal may still be on its way, and the default action for SIGPROF is
+  //to terminate, so our handler stays unless there was another one before
+  if (previousAction.sa_handler != SIG_DFL && previousAction.sa_handler != SIG_IGN) {
+    sigaction(SIGPROF, &previousAction, 0);
+  }
+
+  drainer.join();
+  drain();
+  running = false;
+#endif
+}
+
+//Throw away the samples taken so far
+void dvm_profile_reset() {
+  drain();
+
+  std::lock_guard<std::mutex> guard(profileLock);
+  profiles.clear();
+  programs.clear();
+  ticks = 0;
+  taken = 0;
+  dropped = 0;
+
+  //Running vms describe their programs again
+  if (dvm_profile_generation != 0) {
+    if (++lastGeneration == 0) ++lastGeneration;
+    dvm_profile_generation = lastGeneration;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Reporting
+
+static std::string fn_name(const ProgramInfo *info, int fn) {
+  if (fn == PROFILE_MAIN) return "(main)";
+  if (fn == PROFILE_UNKNOWN) return "(unknown)";
+  if (info && fn < (int)info->names.size() && !info->names[fn].empty()) {
+    return info->names[fn];
+  }
+
+  char name[16];
+  snprintf(name, sizeof(name), "fn %i", fn);
+  return name;
+}
+
+typedef std::pair<unsigned long long, int> Count;
+
+//The entries of a map, most samples first
+static std::vector<Count> by_count(const std::map<int, unsigned long long> &m) {
+  std::vector<Count> counts;
+  std::map<int, unsigned long long>::const_iterator it;
+  for (it = m.begin(); it != m.end(); ++it) {
+    counts.push_back(Count(it->second, it->first));
+  }
+  std::sort(counts.rbegin(), counts.rend());
+  return counts;
+}
+
+//Send a report of where the samples were taken to fn. Programs, functions 
+//and lines are listed with the most samples first.
+void dvm_profile_report(DVMOUTFN fn) {
+  drain();
+
+  std::string out;
+  std::lock_guard<std::mutex> guard(profileLock);
+
+  dvm_appendf(out, "%llu samples, %llu in vms, %llu dropped\n",
+          (unsigned long long)ticks, (unsigned long long)taken, (unsigned long long)dropped);
+
+  std::vector<std::pair<unsigned long long, unsigned int> > order;
+  std::map<unsigned int, ProgramProfile>::const_iterator it;
+  for (it = profiles.begin(); it != profiles.end(); ++it) {
+    order.push_back(std::make_pair(it->second.samples, it->first));
+  }
+  std::sort(order.rbegin(), order.rend());
+
+  for (size_t i = 0; i < order.size(); i++) {
+    const ProgramProfile &p = profiles[order[i].second];
+    std::map<unsigned int, ProgramInfo>::const_iterator info = programs.find(order[i].second);
+    const ProgramInfo *pi = info != programs.end() ? &info->second : 0;
+    double total = (double)p.samples;
+
+    std::string name = dvm_metrics_program_name(order[i].second);
+    dvm_appendf(out, "\nprogram %s: %llu samples\n", name.c_str(), p.samples);
+
+    dvm_appendf(out, "  %-28s %7s %7s\n", "function", "self", "total");
+    std::vector<Count> fns = by_count(p.fnTotal);
+    for (size_t f = 0; f < fns.size(); f++) {
+      std::map<int, unsigned long long>::const_iterator self = p.fnSelf.find(fns[f].second);
+      unsigned long long selfCount = self != p.fnSelf.end() ? self->second : 0;
+      dvm_appendf(out, "  %-28s %6.1f%% %6.1f%%\n", fn_name(pi, fns[f].second).c_str(), 
+              100.0 * selfCount / total, 100.0 * fns[f].first / total);
+    }
+
+    dvm_appendf(out, "  %-28s %7s\n", "line", "self");
+    std::vector<Count> lines = by_count(p.lines);
+    for (size_t l = 0; l < lines.size(); l++) {
+      int line = lines[l].second;
+      if (line >= 0) {
+        dvm_appendf(out, "  line %-23i %6.1f%%\n", line, 100.0 * lines[l].first / total);
+      } else {
+        dvm_appendf(out, "  word %-23i %6.1f%%\n", -1 - line, 100.0 * lines[l].first / total);
+      }
+    }
+  }
+
+  fn(out.c_str());
+}
@@ -0,0 +1,76 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_profile__
+#define h__dvm_profile__
+
+#include <atomic>
+
+#include "dvm.h"
+
+//Sampling profiler.
+//
+//While profiling, a SIGPROF timer interrupts whatever thread is using the
+//CPU. If that thread is running a vm, the signal handler copies the vm's 
+//program cursor and sub routine call stack into a sample. Samples are 
+//added up on a background thread, per source line and per function, so 
+//nothing is counted by the vm itself.
+//
+//A vm publishes where it is through a ProfileSlot for the duration of a run.
+//The slot points into the vm, and is only read by the signal handler on the
+//thread the vm runs on.
+
+//Number of sub routine calls kept per sample
+#define PROFILE_FRAMES  16
+//Samples that can be waiting to be added up
+#define PROFILE_SAMPLES 4096
+
+typedef struct ProfileSlot {
+  //Identifies the program (see dvm_program_hash)
+  unsigned int program;
+  const volatile int *cursor;
+  const volatile int *callstack;
+  const volatile int *callstackPointer;
+  int callstackSize;
+} ProfileSlot;
+
+//Nonzero while profiling. Changes each time profiling is started or reset,
+//so that vms know when to describe their program again.
+extern std::atomic<unsigned int> dvm_profile_generation;
+
+//Publish the slot of the vm that is about to run on this thread. Returns
+//the slot that was published before, to be restored when the run is done.
+extern ProfileSlot *dvm_profile_enter(ProfileSlot *slot);
+extern void dvm_profile_leave(ProfileSlot *previous);
+
+//Tell the profiler about a program, so it can map samples back to the 
+//source. src may be NULL if there's no source.
+extern void dvm_profile_program(unsigned int program, const short *prog, int size, const ProgramSource *src);
+
+#endif
@@ -0,0 +1,70 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#include <stdio.h>
+
+#include "dvm.h"
+#include "record.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Write a recording to a file
+bool dvm_recording_save(const DVMRecording *r, const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    return false;
+  }
+
+  bool ok = r->data.empty() || fwrite(&r->data[0], r->data.size(), 1, f) == 1;
+  return fclose(f) == 0 && ok;
+}
+
+//Read a recording from a file. Returns NULL if it can't be read.
+DVMRecording *dvm_recording_load(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return 0;
+  }
+
+  DVMRecording *r = new DVMRecording;
+  r->readPos = 0;
+
+  unsigned char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    rec_put(r, buffer, n);
+  }
+
+  fclose(f);
+  return r;
+}
+
+void dvm_recording_free(DVMRecording *r) {
+  delete r;
+}
@@ -0,0 +1,81 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_record__
+#define h__dvm_record__
+
+#include <string.h>
+#include <vector>
+
+//A recording is a byte log of events. It starts with a header and a 
+//snapshot of the vm state, followed by the events in the order they 
+//happened:
+//
+//  REC_STATE  the vm state again, if the host changed it in between runs
+//  REC_RUN
+//  REC_BUDGET unsigned int budget
+//  REC_CALL   unsigned char id, int stackPointer, double stack[stackPointer]
+//  REC_END    unsigned int hash of the state after the last run
+//
+//Everything is stored in host byte order.
+
+#define REC_MAGIC   "DVMR"
+#define REC_VERSION 2
+
+enum RecordEvent {
+  REC_STATE  = 'S', //Snapshot of the vm state
+  REC_RUN    = 'R', //A run without a budget was started
+  REC_BUDGET = 'B', //A run with a budget was started, so it yields after that many instructions
+  REC_CALL   = 'C', //A host function was called, followed by the stack after the call
+  REC_END    = 'E'  //The recording was stopped
+};
+
+struct DVMRecording {
+  std::vector<unsigned char> data;
+  //Where we are in data when replaying
+  size_t readPos;
+};
+
+//Append raw data to a recording
+inline void rec_put(DVMRecording *r, const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char*)data;
+  r->data.insert(r->data.end(), p, p + size);
+}
+
+//Read raw data from a recording. Returns false if there isn't enough left.
+inline bool rec_get(DVMRecording *r, void *data, size_t size) {
+  if (r->data.size() - r->readPos < size) {
+    return false;
+  }
+  memcpy(data, &r->data[r->readPos], size);
+  r->readPos += size;
+  return true;
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+//Hot reloading of scripts.
+//
+//A DVMScript owns the image compiled from a file. When the file changes, 
+//it's recompiled and the new image replaces the old one. Runs that already
+//have the old image loaded keep using it - each vm holds a reference to its
+//image, so the old one is released once the last of them is done with it.
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "dvm.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+//What we look at to tell if a file has changed since it was compiled
+typedef struct FileStamp {
+  long long mtime; //nanoseconds, where the platform has them
+  long long size;
+
+  bool operator==(const FileStamp &o) const {
+    return mtime == o.mtime && size == o.size;
+  }
+} FileStamp;
+
+struct DVMScript {
+  std::string filename;
+
+  //The image new runs should use
+  ProgramImage *current;
+  //Guards current
+  std::mutex lock;
+
+  //Makes sure only one reload happens at a time
+  std::mutex reloadLock;
+  //The file as it was when the current image was compiled, and when it
+  //last failed to compile
+  FileStamp stamp;
+  FileStamp failed;
+
+  //Background polling (see dvm_script_watch)
+  std::thread watcher;
+  std::atomic<bool> watching;
+};
+
+//Stat a file. Returns false if it can't be read.
+static bool file_stamp(const char *filename, FileStamp &stamp) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return false;
+  }
+
+  stamp.mtime = (long long)st.st_mtime * 1000000000LL;
+#if defined(__linux__)
+  stamp.mtime += st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+  stamp.mtime += st.st_mtimespec.tv_nsec;
+#endif
+  stamp.size = st.st_size;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Open a script and compile it. Returns NULL if it can't be compiled.
+DVMScript *dvm_script_open(const char *filename) {
+  DVMScript *s = new DVMScript;
+  s->filename = filename;
+  s->current = 0;
+  s->stamp.mtime = -1;
+  s->stamp.size = -1;
+  s->failed = s->stamp;
+  s->watching = false;
+
+  if (!dvm_script_poll(s)) {
+    delete s;
+    return 0;
+  }
+
+  return s;
+}
+
+//Close a script. VMs that have its image loaded can keep running it.
+void dvm_script_close(DVMScript *s) {
+  if (!s) {
+    return;
+  }
+
+  if (s->watching) {
+    s->watching = false;
+    s->watcher.join();
+  }
+
+  dvm_image_release(s->current);
+  delete s;
+}
+
+//Check if the file has changed, and if so recompile it and swap in the new
+//image. Only this script's file is compiled. Returns true if a new image 
+//was swapped in. If the file doesn't compile without errors, the old image
+//stays, and the file isn't compiled again until it changes.
+bool dvm_script_poll(DVMScript *s) {
+  std::lock_guard<std::mutex> reload(s->reloadLock);
+
+  FileStamp stamp;
+  if (!file_stamp(s->filename.c_str(), stamp) || stamp == s->stamp || stamp == s->failed) {
+    return false;
+  }
+
+  //Compiling is done without holding the lock, so runs can start on the
+  //old image while this is going on
+  ProgramSource *src = new ProgramSource(dvm_compile(s->filename.c_str()));
+  bool clean = src->errors == 0 && src->programSize > 0;
+
+  //If the file changed while it was compiled (say an editor was half way 
+  //through writing it), what was compiled may be neither version. It's 
+  //compiled again on the next poll.
+  FileStamp after;
+  if (!file_stamp(s->filename.c_str(), after) || !(after == stamp)) {
+    delete src;
+    return false;
+  }
+
+  ProgramImage *img = clean ? dvm_image_create(*src) : 0;
+  delete src;
+
+  if (!img) {
+    s->failed = stamp;
+    return false;
+  }
+  s->stamp = stamp;
+
+  ProgramImage *old;
+  {
+    std::lock_guard<std::mutex> guard(s->lock);
+    old = s->current;
+    s->current = img;
+  }
+
+  //The script's reference to the old image. VMs still running it have 
+  //their own.
+  dvm_image_release(old);
+  return true;
+}
+
+//Poll the script on a background thread every intervalMs milliseconds,
+//until it's closed
+void dvm_script_watch(DVMScript *s, int intervalMs) {
+  if (s->watching) {
+    return;
+  }
+
+  s->watching = true;
+  s->watcher = std::thread([s, intervalMs]() {
+    while (s->watching) {
+      dvm_script_poll(s);
+      std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+    }
+  });
+}
+
+//Get the current image of a script, with a reference added. The caller 
+//must release it when done (loading it into a vm adds a reference of its
+//own, so it can be released straight after dvm_vm_load).
+ProgramImage *dvm_script_acquire(DVMScript *s) {
+  std::lock_guard<std::mutex> guard(s->lock);
+  dvm_image_retain(s->current);
+  return s->current;
+}
@@ -0,0 +1,115 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_trace__
+#define h__dvm_trace__
+
+#include "types.h"
+
+//Traces of hot loops.
+//
+//The vm counts how often each label is jumped back to. Once a label is hot,
+//the loop from the label to the conditional jump back to it is decoded into
+//a trace, if the loop is made of nothing but integer register moves and 
+//math, and ends in a CMP followed by the jump. From then on, jumping back 
+//to the label runs the trace instead:
+//
+// * Constants are decoded once, when the trace is made
+// * The registers are read into integers when the trace is entered, and
+//   written back when it's left
+// * The compare and the jump back are done as one step
+//
+//The interpreter does all math in floats, so the trace only gives the same
+//results as long as every value fits in a float exactly and every result 
+//fits in its register. That's checked while running the trace. If a check
+//fails, the iteration is thrown away and the interpreter runs it instead.
+//Only whole iterations are run, so the trace stops at the same points as
+//the interpreter when running with a budget.
+
+//Longest loop that's traced, in instructions
+#define TRACE_OPS   32
+//Number of traces a vm keeps
+#define TRACE_SLOTS 8
+//Times a trace can fail its checks before it's dropped
+#define TRACE_FAILS 16
+
+//Largest integer a float holds exactly
+#define TRACE_LIMIT 16777216LL
+
+//Stored in place of a trace slot for labels without a trace
+#define TRACE_NONE  -1 //Not hot yet
+#define TRACE_NEVER -2 //Can't be traced, or the trace was dropped
+
+enum TraceOpKind {
+  T_ADD, //INC and DEC are turned into adding and subtracting 1
+  T_SUB,
+  T_MUL,
+  T_MOV,
+  T_CMP
+};
+
+//While a trace runs, the integer registers are kept in an array, indexed by
+//operand (R_AS-R_LI). The constants of the trace follow them, so that every
+//operand of an operation is just an index into the array.
+#define TRACE_CONSTANTS (2 * TRACE_OPS)
+#define TRACE_VALUES    (R_LI + 1 + TRACE_CONSTANTS)
+
+typedef struct TraceOp {
+  unsigned char kind;
+  unsigned char a;
+  unsigned char b;
+  //Where the instruction is in the program, for the profiler
+  int cursor;
+  //The range the result must be in to fit register a exactly
+  long long lo;
+  long long hi;
+} TraceOp;
+
+typedef struct Trace {
+  //The label the loop starts at
+  int symbol;
+  //The last word of the jump back, where the loop is left
+  int exit;
+  //The jump back
+  Instruction branch;
+
+  //Instructions per iteration, counting the ones that do nothing
+  int length;
+  TraceOp ops[TRACE_OPS];
+  int count;
+
+  long long constants[TRACE_CONSTANTS];
+  int constantCount;
+
+  //The registers the trace uses, one bit per operand
+  unsigned int used;
+  int fails;
+} Trace;
+
+#endif
@@ -68,6 +68,20 @@ enum Instruction {
   //IO
   PRINT,	//Print
   PRINTL, //Print line
+
+  //MEMORY
+  LOAD,   //28: Load a value from the memory segment into a register
+  STORE,  //29: Store a value in the memory segment
+
+  //VECTOR (work on spans of the memory segment)
+  VLEN,   //30: Set the number of elements the vector operations work on
+  VADD,   //31: Add one span to another
+  VMUL,   //32: Multiply one span with another
+  VSCALE, //33: Multiply each element in a span with a value
+  VDOT,   //34: Dot product of two spans, pushed onto the stack
+  VSUM,   //35: Sum of a span, pushed onto the stack
+  VSIN,   //36: Sin of each element in a span
+  VCOS,   //37: Cos of each element in a span
   
 };
 
@@ -103,6 +117,21 @@ enum Operand {
 
 };
 
+//True for the instructions whose low byte is a symbol rather than two 
+//operands (FN, DO, LBL and the jumps). A symbol can look like a constant 
+//operand, but these never have data words following them.
+inline bool ins_has_symbol(Instruction ins) {
+  return ins >= FN && ins <= JGE;
+}
+
+//The number of data words following an instruction
+inline int ins_data_words(short c) {
+  if (ins_has_symbol(Instruction((c & 0xFF00) >> 8))) {
+    return 0;
+  }
+  return (((c & 0x00F0) >> 4) >= R_SH) + ((c & 0x000F) >= R_SH);
+}
+
 
 
 
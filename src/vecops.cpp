@@ -0,0 +1,316 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "vecops.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define DVM_VEC_X86 1
+#   include <immintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+//A set of kernels for one instruction set
+typedef struct VecKernels {
+  const char *name;
+  void (*add)(float *dst, const float *src, int count);
+  void (*mul)(float *dst, const float *src, int count);
+  void (*scale)(float *dst, float k, int count);
+  float (*dot)(const float *a, const float *b, int count);
+  float (*sum)(const float *a, int count);
+} VecKernels;
+
+////////////////////////////////////////////////////////////////////////////////
+//Plain C kernels. These are used when nothing better is available, and to
+//handle the tail end of the spans in the SIMD kernels.
+//
+//The order floats are added in changes the result, so every kernel set adds
+//up dot products and sums the same way, and gives the same bits: there are
+//VEC_LANES partial sums, sum l gets the elements at l, l + 8, l + 16 and so 
+//on, and the partial sums are added up as a tree at the end. The scalar and
+//SSE kernels emulate the 8 lanes of AVX.
+
+#define VEC_LANES 8
+
+//Add up the partial sums
+static float lanes_total(const float *lanes) {
+  float half[4];
+  for (int l = 0; l < 4; l++) half[l] = lanes[l] + lanes[l + 4];
+  return (half[0] + half[2]) + (half[1] + half[3]);
+}
+
+//Add the elements from start on to the partial sums. start must be a 
+//multiple of VEC_LANES.
+static void lanes_dot(float *lanes, const float *a, const float *b, int start, int count) {
+  for (int i = start; i < count; i++) {
+    float p = a[i] * b[i];
+    lanes[i % VEC_LANES] += p;
+  }
+}
+
+static void lanes_sum(float *lanes, const float *a, int start, int count) {
+  for (int i = start; i < count; i++) lanes[i % VEC_LANES] += a[i];
+}
+
+static void scalar_add(float *dst, const float *src, int count) {
+  for (int i = 0; i < count; i++) dst[i] += src[i];
+}
+
+static void scalar_mul(float *dst, const float *src, int count) {
+  for (int i = 0; i < count; i++) dst[i] *= src[i];
+}
+
+static void scalar_scale(float *dst, float k, int count) {
+  for (int i = 0; i < count; i++) dst[i] *= k;
+}
+
+static float scalar_dot(const float *a, const float *b, int count) {
+  float lanes[VEC_LANES] = { 0 };
+  lanes_dot(lanes, a, b, 0, count);
+  return lanes_total(lanes);
+}
+
+static float scalar_sum(const float *a, int count) {
+  float lanes[VEC_LANES] = { 0 };
+  lanes_sum(lanes, a, 0, count);
+  return lanes_total(lanes);
+}
+
+static const VecKernels scalarKernels = {
+  "scalar", scalar_add, scalar_mul, scalar_scale, scalar_dot, scalar_sum
+};
+
+#ifdef DVM_VEC_X86
+
+////////////////////////////////////////////////////////////////////////////////
+//SSE kernels - 4 floats at a time
+
+__attribute__((target("sse")))
+static void sse_add(float *dst, const float *src, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+  }
+  scalar_add(dst + i, src + i, count - i);
+}
+
+__attribute__((target("sse")))
+static void sse_mul(float *dst, const float *src, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+  }
+  scalar_mul(dst + i, src + i, count - i);
+}
+
+__attribute__((target("sse")))
+static void sse_scale(float *dst, float k, int count) {
+  __m128 kv = _mm_set1_ps(k);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), kv));
+  }
+  scalar_scale(dst + i, k, count - i);
+}
+
+//Two registers make up the 8 lanes
+__attribute__((target("sse")))
+static float sse_dot(const float *a, const float *b, int count) {
+  __m128 lo = _mm_setzero_ps();
+  __m128 hi = _mm_setzero_ps();
+  int i = 0;
+  for (; i + VEC_LANES <= count; i += VEC_LANES) {
+    lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  float lanes[VEC_LANES];
+  _mm_storeu_ps(lanes, lo);
+  _mm_storeu_ps(lanes + 4, hi);
+  lanes_dot(lanes, a, b, i, count);
+  return lanes_total(lanes);
+}
+
+__attribute__((target("sse")))
+static float sse_sum(const float *a, int count) {
+  __m128 lo = _mm_setzero_ps();
+  __m128 hi = _mm_setzero_ps();
+  int i = 0;
+  for (; i + VEC_LANES <= count; i += VEC_LANES) {
+    lo = _mm_add_ps(lo, _mm_loadu_ps(a + i));
+    hi = _mm_add_ps(hi, _mm_loadu_ps(a + i + 4));
+  }
+  float lanes[VEC_LANES];
+  _mm_storeu_ps(lanes, lo);
+  _mm_storeu_ps(lanes + 4, hi);
+  lanes_sum(lanes, a, i, count);
+  return lanes_total(lanes);
+}
+
+static const VecKernels sseKernels = {
+  "sse", sse_add, sse_mul, sse_scale, sse_dot, sse_sum
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//AVX kernels - 8 floats at a time
+
+__attribute__((target("avx")))
+static void avx_add(float *dst, const float *src, int count) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+  }
+  scalar_add(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx")))
+static void avx_mul(float *dst, const float *src, int count) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+  }
+  scalar_mul(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx")))
+static void avx_scale(float *dst, float k, int count) {
+  __m256 kv = _mm256_set1_ps(k);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), kv));
+  }
+  scalar_scale(dst + i, k, count - i);
+}
+
+__attribute__((target("avx")))
+static float avx_dot(const float *a, const float *b, int count) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + VEC_LANES <= count; i += VEC_LANES) {
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  }
+  float lanes[VEC_LANES];
+  _mm256_storeu_ps(lanes, acc);
+  lanes_dot(lanes, a, b, i, count);
+  return lanes_total(lanes);
+}
+
+__attribute__((target("avx")))
+static float avx_sum(const float *a, int count) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + VEC_LANES <= count; i += VEC_LANES) {
+    acc = _mm256_add_ps(acc, _mm256_loadu_ps(a + i));
+  }
+  float lanes[VEC_LANES];
+  _mm256_storeu_ps(lanes, acc);
+  lanes_sum(lanes, a, i, count);
+  return lanes_total(lanes);
+}
+
+static const VecKernels avxKernels = {
+  "avx", avx_add, avx_mul, avx_scale, avx_dot, avx_sum
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Find a kernel set by name. NULL picks the best one for the CPU we're 
+//running on. Returns NULL if the CPU doesn't support the one asked for.
+static const VecKernels *vec_find(const char *isa) {
+#ifdef DVM_VEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx") && (!isa || strcmp(isa, "avx") == 0)) return &avxKernels;
+  if (__builtin_cpu_supports("sse") && (!isa || strcmp(isa, "sse") == 0)) return &sseKernels;
+#endif
+  if (!isa || strcmp(isa, "scalar") == 0) return &scalarKernels;
+  return 0;
+}
+
+static std::atomic<const VecKernels*> kernels(0);
+
+//Returns the kernel set in use. The selection happens on first use.
+static const VecKernels *vec() {
+  const VecKernels *k = kernels.load(std::memory_order_relaxed);
+  if (!k) {
+    k = vec_find(0);
+    kernels.store(k, std::memory_order_relaxed);
+  }
+  return k;
+}
+
+//Force a kernel set ("scalar", "sse" or "avx"), or go back to the best one
+//for the CPU with NULL. Returns false if the CPU doesn't support it.
+bool dvm_vec_select(const char *isa) {
+  const VecKernels *k = vec_find(isa);
+  if (!k) {
+    return false;
+  }
+  kernels.store(k, std::memory_order_relaxed);
+  return true;
+}
+
+void dvm_vec_add(float *dst, const float *src, int count) {
+  vec()->add(dst, src, count);
+}
+
+void dvm_vec_mul(float *dst, const float *src, int count) {
+  vec()->mul(dst, src, count);
+}
+
+void dvm_vec_scale(float *dst, float k, int count) {
+  vec()->scale(dst, k, count);
+}
+
+float dvm_vec_dot(const float *a, const float *b, int count) {
+  return vec()->dot(a, b, count);
+}
+
+float dvm_vec_sum(const float *a, int count) {
+  return vec()->sum(a, count);
+}
+
+//There are no SIMD versions of sin and cos in SSE/AVX, so these always
+//go through libm.
+void dvm_vec_sin(float *dst, int count) {
+  for (int i = 0; i < count; i++) dst[i] = sinf(dst[i]);
+}
+
+void dvm_vec_cos(float *dst, int count) {
+  for (int i = 0; i < count; i++) dst[i] = cosf(dst[i]);
+}
+
+const char *dvm_vec_isa() {
+  return vec()->name;
+}
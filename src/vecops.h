@@ -0,0 +1,53 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_vecops__
+#define h__dvm_vecops__
+
+//Bulk kernels backing the vector instructions. The implementation used
+//(scalar, SSE or AVX) is picked the first time one of them is called, based
+//on what the CPU supports. All of them give the same results, down to the 
+//order in which dot products and sums are added up.
+
+extern void dvm_vec_add(float *dst, const float *src, int count);
+extern void dvm_vec_mul(float *dst, const float *src, int count);
+extern void dvm_vec_scale(float *dst, float k, int count);
+extern float dvm_vec_dot(const float *a, const float *b, int count);
+extern float dvm_vec_sum(const float *a, int count);
+extern void dvm_vec_sin(float *dst, int count);
+extern void dvm_vec_cos(float *dst, int count);
+
+//Returns the name of the kernel set in use ("scalar", "sse" or "avx")
+extern const char *dvm_vec_isa();
+
+//Force a kernel set, or go back to the best one for the CPU with NULL. 
+//Returns false if the CPU doesn't support it.
+extern bool dvm_vec_select(const char *isa);
+
+#endif
@@ -0,0 +1,1684 @@
+/*******************************************************************************
+
+Copyright (c) 2014, Chris Vasseng
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL IQUMULUS LLC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*******************************************************************************/
+
+#ifndef h__dvm_vm__
+#define h__dvm_vm__
+
+//The VM core. Everything here is a template over a config type, so that an
+//embedding can pick the register file, the sizes of the stacks and segments,
+//which instructions are there at all and how much checking is done, and get
+//an interpreter compiled for exactly that. The vms created through dvm.h use
+//DefaultConfig.
+//
+//A config is usually made by deriving from DefaultConfig and overriding what
+//needs to change:
+//
+//  struct TinyConfig : DefaultConfig {
+//    static const int FLOAT_REGS = 0;
+//    static const int STACK_SIZE = 16;
+//    static const int CALLSTACK = 8;
+//    static const int MEMORY_SIZE = 0;
+//    static const unsigned int FEATURES = OPS_MATH | OPS_HOST;
+//    static const bool METRICS = false;
+//    static const bool TRACES = false;
+//    static const bool PROFILE = false;
+//  };
+//
+//  BasicVM<TinyConfig> vm;
+//  dvm_vm_clear(vm);
+//  dvm_vm_load(vm, src);
+//  dvm_run(vm);
+//  dvm_vm_release(vm);
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <limits>
+#include <atomic>
+
+#include "dvm.h"
+#include "types.h"
+#include "vecops.h"
+#include "image.h"
+#include "record.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+
+//If enabled, the VM will log everything it does to stdout
+#ifdef PROGRAM_LOG
+#   define DEBUG_PLOG(x) printf x
+#else
+#   define DEBUG_PLOG(x) do {} while (0)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Describes a comparison result
+enum CompareResult {
+  LESS,
+  GREATER,
+  LEQUAL,
+  GEQAUL,
+  EQUAL,
+  NEQUAL
+};
+
+//Groups of instructions that a config can leave out. Instructions that
+//aren't in any group (moves, compares, the stack, jumps and sub routines)
+//are always there.
+enum OpGroup {
+  OPS_CORE   = 0,
+  OPS_MATH   = 1 << 0, //ADD, INC, DEC, SUB, MUL, DIV, SIN, COS
+  OPS_IO     = 1 << 1, //PRINT, PRINTL
+  OPS_HOST   = 1 << 2, //CALL, ARG
+  OPS_MEMORY = 1 << 3, //LOAD, STORE and the vector operations
+  OPS_ALL    = OPS_MATH | OPS_IO | OPS_HOST | OPS_MEMORY
+};
+
+//The group an instruction belongs to
+constexpr unsigned int op_group(Instruction ins) {
+  return ins >= ADD && ins <= COS ? OPS_MATH :
+         ins == PRINT || ins == PRINTL ? OPS_IO :
+         ins == CALL || ins == ARG ? OPS_HOST :
+         ins >= LOAD && ins <= VCOS ? OPS_MEMORY :
+         OPS_CORE;
+}
+
+//True if an instruction is part of vms with the given config. This is
+//evaluated at compile time, so the cases of instructions that are left out
+//compile to nothing, and the instructions are skipped like a NOP.
+template <typename Config>
+constexpr bool op_enabled(Instruction ins) {
+  return op_group(ins) == OPS_CORE || (Config::FEATURES & op_group(ins)) != 0;
+}
+
+//Arrays in a vm can't be empty, even if the config doesn't want any slots
+constexpr int dvm_slots(int count) {
+  return count > 0 ? count : 1;
+}
+
+//The configuration of the vms created through dvm.h
+struct DefaultConfig {
+  //The register file. There can be up to four registers of each class.
+  //Operands naming a register that isn't there read as 0, and writes to it
+  //are ignored.
+  typedef short Int16; //as, bs, cs, ds
+  typedef int   Int32; //ii, ji, ki, li
+  typedef float Float; //xf, yf, zf, wf
+  static const int INT16_REGS = 4;
+  static const int INT32_REGS = 4;
+  static const int FLOAT_REGS = 4;
+
+  //What the instructions compute with
+  typedef float Value;
+
+  //The largest program that can be loaded, in words. Images are used in
+  //place, so they aren't limited by this.
+  static const int PROGRAM_SIZE = 1024;
+  //The number of labels and functions a program can have
+  static const int SYMBOLS = 256;
+  //Depth of the value stack and of the sub routine call stack
+  static const int STACK_SIZE = 64;
+  static const int CALLSTACK = 1024;
+  //Size of the vm's own memory segment, in floats
+  static const int MEMORY_SIZE = 4096;
+  //Size of the constant pool when loading a ProgramSource
+  static const int CONSTANTS = 256;
+
+  //The instruction groups that are compiled in (see OpGroup)
+  static const unsigned int FEATURES = OPS_ALL;
+
+  //If false, the checks that a well formed program can never fail (reading
+  //data words past the end of the program, and constants past the end of
+  //the pool) are left out. Programs are verified when they are loaded into
+  //such a vm instead, and aren't run if they aren't well formed. Recordings
+  //replayed into it must be trusted.
+  static const bool CHECKED = true;
+
+  //If true, the vm keeps metrics while it runs, and adds them to the 
+  //exported metrics when each run is done (see metrics.h)
+  static const bool METRICS = true;
+
+  //If true, hot loops are run as traces (see trace.h). A loop is traced
+  //once it has been jumped back to TRACE_HOT times.
+  static const bool TRACES = true;
+  static const int TRACE_HOT = 64;
+
+  //If true, the vm shows the sampling profiler where it is while it runs
+  //(see profile.h). This costs nothing until the profiler is started.
+  static const bool PROFILE = true;
+};
+
+//Contains the current state of a VM
+template <typename Config>
+struct BasicVM {
+  typedef typename Config::Value Value;
+
+  static_assert(Config::INT16_REGS >= 0 && Config::INT16_REGS <= 4 &&
+                Config::INT32_REGS >= 0 && Config::INT32_REGS <= 4 &&
+                Config::FLOAT_REGS >= 0 && Config::FLOAT_REGS <= 4,
+                "There can be at most four registers of each class");
+  static_assert(Config::SYMBOLS > 0 && Config::SYMBOLS <= IMAGE_SYMBOLS,
+                "Symbols are stored in a byte, so there can be at most 256");
+  static_assert(Config::PROGRAM_SIZE < IMAGE_NO_SYMBOL,
+                "Program locations must fit in a symbol");
+
+  //int16 registers
+  typename Config::Int16 int16Reg[dvm_slots(Config::INT16_REGS)];
+  //int registers
+  typename Config::Int32 int32Reg[dvm_slots(Config::INT32_REGS)];
+  //float registers
+  typename Config::Float floatReg[dvm_slots(Config::FLOAT_REGS)];
+
+  //Our symbols - the location of each label and function in the program
+  const short *symbols;
+  //Our stack
+  double stack[dvm_slots(Config::STACK_SIZE)];
+  //Stack pointer
+  int stackPointer;
+
+  //The program we're currently running. This is never written to, and
+  //may be shared with other VMs (and processes, if it's a mapped image).
+  const short *program;
+  //The program cursor - our position within the program array
+  int programCursor;
+  //The size of the program in memory.
+  //This is the number of elements in the program array, not bytes.
+  int programSize;
+
+  //The constant pool of the program, converted to what the vm computes 
+  //with when loaded, so that reading a constant is a single indexed read.
+  //Images keep their pool typed, so it's converted for them too.
+  typename Config::Value constants[dvm_slots(Config::CONSTANTS)];
+  //The int constants as they are in the pool, so that they can be moved
+  //into and compared with the 32-bit registers exactly
+  int constantInts[dvm_slots(Config::CONSTANTS)];
+  int constantCount;
+
+  //The image the program comes from, if any. The vm holds a reference to
+  //it until another program is loaded.
+  ProgramImage *image;
+
+  //Identifies the program (see dvm_program_hash)
+  unsigned int programHash;
+
+  //Used for the symbols when the program isn't an image
+  short symbolData[Config::SYMBOLS];
+
+  //Stores the result of the last compare preformed
+  CompareResult lastCmp;
+
+  //Callstack
+  int callstack[dvm_slots(Config::CALLSTACK)];
+  int callstackPointer;
+
+  //The memory segment used by LOAD/STORE and the vector operations.
+  //Points at memoryData unless the host has mapped its own buffer.
+  float *memory;
+  int memorySize;
+  float memoryData[dvm_slots(Config::MEMORY_SIZE)];
+
+  //The number of elements the vector operations work on
+  int vectorLength;
+
+  //Set while the vm is being recorded
+  DVMRecording *recording;
+  //Hash of the state of the vm at the end of the last recorded run
+  unsigned int recordedState;
+  //Set while the vm is replaying a recording
+  DVMRecording *replaying;
+  //Set if the program did something other than what was recorded
+  bool replayFailed;
+
+  //What the vm has done since the end of the last run
+  RunMetrics metrics;
+  unsigned int hostCalls[Config::METRICS ? METRICS_HOST_FNS : 1];
+  unsigned long long hostNanos[Config::METRICS ? METRICS_HOST_FNS : 1];
+
+  //How often each label has been jumped back to, and the slot of its
+  //trace (or TRACE_NONE/TRACE_NEVER)
+  unsigned short traceHits[Config::TRACES ? Config::SYMBOLS : 1];
+  signed char traceSlot[Config::TRACES ? Config::SYMBOLS : 1];
+  Trace traces[Config::TRACES ? TRACE_SLOTS : 1];
+  int traceCount;
+
+  //The source of the program, if it was loaded from one. The profiler uses
+  //it to map words to lines.
+  const ProgramSource *source;
+  //Where the profiler finds the vm while it runs, and the profiler
+  //generation the program was last described to it in
+  ProfileSlot profileSlot;
+  unsigned int profileGeneration;
+
+};
+
+extern DVMFN dvm_functions[256];
+
+//Where PRINT and PRINTL write to
+extern DVMOUTFN dvm_output;
+
+////////////////////////////////////////////////////////////////////////////////
+//The following are utility functions to make things a bit more tidy
+
+//Read two bytes from the program and return it
+template <typename Config>
+inline short read2b(BasicVM<Config> &v) {
+  ++v.programCursor;
+  if (Config::CHECKED && v.programCursor >= v.programSize) {
+    return 0;
+  }
+  return v.program[v.programCursor];
+}
+
+//Read a constant pool index from the program and return the constant
+template <typename Config>
+inline typename Config::Value readConst(BasicVM<Config> &v) {
+  unsigned short index = read2b(v);
+  if (Config::CHECKED && index >= v.constantCount) {
+    return 0;
+  }
+  return v.constants[index];
+}
+
+//True if the register an operand names is part of the register file
+template <typename Config>
+inline bool hasReg(Operand opa) {
+  return (opa >= R_AS && opa < R_AS + Config::INT16_REGS) ||
+         (opa >= R_II && opa < R_II + Config::INT32_REGS) ||
+         (opa >= R_XF && opa < R_XF + Config::FLOAT_REGS);
+}
+
+//Convert a value to an int. Converting a value that doesn't fit is undefined,
+//so those (and NaN) become INT_MIN, which is what x86 gives. The int16 
+//registers keep the low bits of that.
+inline int to_int(double val) {
+  return val > -2147483649.0 && val < 2147483648.0 ? (int)val : std::numeric_limits<int>::min();
+}
+
+//True if the operands are a 32-bit register and an int constant. Those are
+//used without converting them to a Value, as a float only holds ints up to 
+//2^24 exactly.
+template <typename Config>
+inline bool exactInt(Operand opa, Operand opb) {
+  return opb == R_IN && opa >= R_II && opa - R_II < Config::INT32_REGS &&
+         std::numeric_limits<typename Config::Int32>::is_integer;
+}
+
+//The int constant that the last word read from the program refers to
+template <typename Config>
+inline int lastConstInt(BasicVM<Config> &v) {
+  if (Config::CHECKED && v.programCursor >= v.programSize) {
+    return 0;
+  }
+  unsigned short index = v.program[v.programCursor];
+  if (Config::CHECKED && index >= v.constantCount) {
+    return 0;
+  }
+  return v.constantInts[index];
+}
+
+//Write to a register
+template <typename Config>
+inline void regw(Operand opa, BasicVM<Config> &v, typename Config::Value val) {
+  if (opa > 0) {
+    if (opa < 5) {
+      if (opa - R_AS < Config::INT16_REGS) v.int16Reg[opa - R_AS] = typename Config::Int16(to_int(val));
+    } else if (opa < 9) {
+      if (opa - R_II < Config::INT32_REGS) v.int32Reg[opa - R_II] = typename Config::Int32(to_int(val));
+    } else if (opa < 13) {
+      if (opa - R_XF < Config::FLOAT_REGS) v.floatReg[opa - R_XF] = val;
+    }
+  }
+}
+
+//Read the value from a register
+template <typename Config>
+inline typename Config::Value regr(Operand opa, BasicVM<Config> &v) {
+  if (opa > 0) {
+    if (opa < 5) {
+      return opa - R_AS < Config::INT16_REGS ? v.int16Reg[opa - R_AS] : 0;
+    } else if (opa < 9) {
+      return opa - R_II < Config::INT32_REGS ? v.int32Reg[opa - R_II] : 0;
+    } else if (opa < 13) {
+      return opa - R_XF < Config::FLOAT_REGS ? v.floatReg[opa - R_XF] : 0;
+    }
+  }
+  return -1.1337f;
+}
+
+//Get the value of an operand relative to current program cursor
+template <typename Config>
+inline typename Config::Value getOperandVal(Operand opa, BasicVM<Config> &v) {
+  if (opa > 0) {
+    if (opa < 13) {
+      return regr(opa, v);
+    } else if (opa == R_SH) {
+      //The short is stored inline
+      return read2b(v);
+    } else {
+      //Ints and floats live in the constant pool
+      return readConst(v);
+    }
+  }
+  return -1.1337f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Here come the traces (see trace.h)
+
+//Forget all traces. Done whenever a program is loaded.
+template <typename Config>
+void trace_reset(BasicVM<Config> &v) {
+  memset(v.traceHits, 0, sizeof(v.traceHits));
+  memset(v.traceSlot, TRACE_NONE, sizeof(v.traceSlot));
+  v.traceCount = 0;
+}
+
+//The range of values that can be stored in a register of type T, and read
+//back into a float, without changing
+template <typename T>
+void trace_range(long long &lo, long long &hi) {
+  lo = (long long)std::numeric_limits<T>::min();
+  hi = (long long)std::numeric_limits<T>::max();
+  if (lo < -TRACE_LIMIT) lo = -TRACE_LIMIT;
+  if (hi > TRACE_LIMIT) hi = TRACE_LIMIT;
+}
+
+template <typename Config>
+void trace_range(int reg, long long &lo, long long &hi) {
+  if (reg < R_II) {
+    trace_range<typename Config::Int16>(lo, hi);
+  } else {
+    trace_range<typename Config::Int32>(lo, hi);
+  }
+}
+
+//Add a constant to a trace. Returns its index in the values of the trace.
+inline unsigned char trace_constant(Trace &t, long long value) {
+  t.constants[t.constantCount] = value;
+  return R_LI + 1 + t.constantCount++;
+}
+
+//Decode an operand of an instruction in a loop that's being traced, the
+//way getOperandVal would. Returns false if it isn't an integer register or
+//an integer constant.
+template <typename Config>
+bool trace_operand(BasicVM<Config> &v, Trace &t, Operand op, int &cursor, unsigned char &index) {
+  index = 0;
+
+  if (op >= R_SH) {
+    short word = ++cursor < v.programSize ? v.program[cursor] : 0;
+    typename Config::Value f = word;
+    if (op != R_SH) {
+      unsigned short i = word;
+      f = i < v.constantCount ? v.constants[i] : 0;
+    }
+    //Checked before converting, so that it can't overflow
+    if (!(f >= -TRACE_LIMIT && f <= TRACE_LIMIT)) {
+      return false;
+    }
+    long long value = (long long)f;
+    if (f != (typename Config::Value)value) {
+      return false;
+    }
+    index = trace_constant(t, value);
+    return true;
+  }
+
+  if (op >= R_AS && op <= R_LI && hasReg<Config>(op)) {
+    index = op;
+    t.used |= 1 << op;
+    return true;
+  }
+
+  return false;
+}
+
+//Make a trace of the loop from a label to the jump back to it, which ends
+//at from. Returns the trace slot, or TRACE_NEVER if it can't be traced.
+template <typename Config>
+int trace_compile(BasicVM<Config> &v, int where, int from) {
+  if (!std::numeric_limits<typename Config::Int16>::is_integer ||
+      !std::numeric_limits<typename Config::Int32>::is_integer ||
+      v.traceCount >= TRACE_SLOTS) {
+    return TRACE_NEVER;
+  }
+
+  Trace &t = v.traces[v.traceCount];
+  t.symbol = where;
+  t.exit = from;
+  t.length = 0;
+  t.count = 0;
+  t.constantCount = 0;
+  t.used = 0;
+  t.fails = 0;
+
+  //The interpreter resumes after the label, so that's where the loop starts
+  int cursor = v.symbols[where] + 1;
+  while (cursor <= from) {
+    short c = v.program[cursor];
+    Instruction ins = Instruction((c & 0xFF00) >> 8);
+    Operand opa = Operand((c & 0x00F0) >> 4);
+    Operand opb = Operand(c & 0x000F);
+    t.length++;
+
+    //The jump back closes the loop, and is fused with the compare before it
+    if (ins >= JMP && ins <= JGE) {
+      if (cursor != from || ins == JMP || (c & 0x00FF) != where ||
+          t.count == 0 || t.ops[t.count - 1].kind != T_CMP) {
+        return TRACE_NEVER;
+      }
+      t.branch = ins;
+      break;
+    }
+
+    if (ins == NOP || ins == LBL) {
+      cursor += ins_data_words(c) + 1;
+      continue;
+    }
+
+    //Each operation adds at most two constants, so they always fit
+    if (t.count >= TRACE_OPS) {
+      return TRACE_NEVER;
+    }
+
+    TraceOp op;
+    op.cursor = cursor;
+    bool okA = trace_operand(v, t, opa, cursor, op.a);
+    bool okB = true;
+
+    switch (ins) {
+      case INC:
+      case DEC:
+        //The right operand is read, but not used
+        if (opb >= R_SH) cursor++;
+        op.kind = ins == INC ? T_ADD : T_SUB;
+        op.b = trace_constant(t, 1);
+        break;
+
+      case ADD: op.kind = T_ADD; okB = trace_operand(v, t, opb, cursor, op.b); break;
+      case SUB: op.kind = T_SUB; okB = trace_operand(v, t, opb, cursor, op.b); break;
+      case MUL: op.kind = T_MUL; okB = trace_operand(v, t, opb, cursor, op.b); break;
+      case MOV: op.kind = T_MOV; okB = trace_operand(v, t, opb, cursor, op.b); break;
+      case CMP: op.kind = T_CMP; okB = trace_operand(v, t, opb, cursor, op.b); break;
+
+      default:
+        return TRACE_NEVER;
+    }
+
+    //Everything but CMP writes to a register
+    if (!okA || !okB || (op.kind != T_CMP && op.a > R_LI)) {
+      return TRACE_NEVER;
+    }
+
+    trace_range<Config>(op.a, op.lo, op.hi);
+    t.ops[t.count++] = op;
+    cursor++;
+  }
+
+  if (cursor != from) {
+    return TRACE_NEVER;
+  }
+
+  DEBUG_PLOG(("Traced loop at %i (%i instructions)\n", v.symbols[where], t.length));
+  return v.traceCount++;
+}
+
+//Count a failed check, and drop the trace if it keeps failing
+template <typename Config>
+void trace_failed(BasicVM<Config> &v, Trace &t) {
+  if (++t.fails > TRACE_FAILS) {
+    DEBUG_PLOG(("Dropped trace at %i\n", v.symbols[t.symbol]));
+    v.traceSlot[t.symbol] = TRACE_NEVER;
+  }
+}
+
+//Run a trace for as many whole iterations as fit in the budget, starting
+//with the vm at the label. Returns the number of instructions executed.
+template <typename Config>
+unsigned int trace_run(BasicVM<Config> &v, Trace &t, unsigned int budget) {
+  long long r[TRACE_VALUES];
+  long long saved[R_LI + 1];
+
+  for (int i = R_AS; i <= R_LI; i++) {
+    if (t.used & 1 << i) {
+      r[i] = i < R_II ? (long long)v.int16Reg[i - R_AS] : (long long)v.int32Reg[i - R_II];
+
+      long long lo, hi;
+      trace_range<Config>(i, lo, hi);
+      if (r[i] < lo || r[i] > hi) {
+        //The interpreter would round this value
+        trace_failed(v, t);
+        return 0;
+      }
+    }
+  }
+  memcpy(r + R_LI + 1, t.constants, sizeof(long long) * t.constantCount);
+
+  CompareResult cmp = v.lastCmp;
+  unsigned int executed = 0;
+  bool done = false;
+  int label = v.programCursor;
+
+  while (!done && budget - executed >= (unsigned int)t.length) {
+    memcpy(saved, r, sizeof(saved));
+    CompareResult savedCmp = cmp;
+    bool failed = false;
+
+    for (int i = 0; i < t.count && !failed; i++) {
+      const TraceOp &op = t.ops[i];
+      long long a = r[op.a];
+      long long b = r[op.b];
+      long long x;
+
+      //Let the profiler see which instruction of the loop this is
+      if (Config::PROFILE) {
+        v.programCursor = op.cursor;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+      }
+
+      switch (op.kind) {
+        case T_ADD: x = a + b; break;
+        case T_SUB: x = a - b; break;
+        case T_MUL: x = a * b; break;
+        case T_MOV: x = b; break;
+        default:
+          cmp = a < b ? LESS : a > b ? GREATER : EQUAL;
+          continue;
+      }
+
+      failed = x < op.lo || x > op.hi;
+      r[op.a] = x;
+    }
+
+    if (failed) {
+      memcpy(r, saved, sizeof(saved));
+      cmp = savedCmp;
+      trace_failed(v, t);
+      break;
+    }
+
+    executed += t.length;
+
+    switch (t.branch) {
+      case JL:  done = cmp != LESS; break;
+      case JG:  done = cmp != GREATER; break;
+      case JE:  done = cmp != EQUAL; break;
+      case JN:  done = cmp == EQUAL; break;
+      case JLE: done = cmp != EQUAL && cmp != LESS; break;
+      case JGE: done = cmp != EQUAL && cmp != GREATER; break;
+      default:  done = true; break;
+    }
+  }
+
+  for (int i = R_AS; i <= R_LI; i++) {
+    if (t.used & 1 << i) {
+      if (i < R_II) {
+        v.int16Reg[i - R_AS] = r[i];
+      } else {
+        v.int32Reg[i - R_II] = r[i];
+      }
+    }
+  }
+  v.lastCmp = cmp;
+
+  //Leave the vm after the jump back if the loop is done, or at the label
+  //for the interpreter to carry on from
+  v.programCursor = done ? t.exit : label;
+
+  return executed;
+}
+
+//A loop has jumped back to a label. Count it, and run the loop's trace if 
+//it has one. budget is what's left after the jump.
+template <typename Config>
+void trace_loop(BasicVM<Config> &v, int where, int from, unsigned int &executed, unsigned int budget) {
+  int slot = v.traceSlot[where];
+
+  if (slot == TRACE_NONE) {
+    if (++v.traceHits[where] < Config::TRACE_HOT) {
+      return;
+    }
+    slot = v.traceSlot[where] = trace_compile(v, where, from);
+  }
+
+  if (slot >= 0) {
+    executed += trace_run(v, v.traces[slot], budget);
+  }
+}
+
+//Preform a jump in the program. This is repeated quite a lot, so it's
+//refactored into a separate function to avoid too much code repetition.
+template <typename Config>
+inline void jmp(int where, BasicVM<Config> &v, unsigned int &executed, unsigned int budget) {
+  if (where < Config::SYMBOLS && v.symbols[where] < v.programSize) {
+    int from = v.programCursor;
+    v.programCursor = v.symbols[where];
+    DEBUG_PLOG(("Jumped to %i\n", v.programCursor));
+
+    //Jumping back is how loops are made. The jump itself is counted by 
+    //the interpreter once it's done.
+    if (Config::TRACES && v.programCursor < from) {
+      trace_loop(v, where, from, executed, budget - executed - 1);
+    }
+  }
+}
+
+//Check that a span of the memory segment is within bounds. The offset is
+//checked before it's converted, as converting a value that doesn't fit in
+//an int is undefined. NaN fails the check.
+template <typename Config>
+inline bool memspan(BasicVM<Config> &v, double offset, int count) {
+  if (!(offset >= 0 && offset < v.memorySize + 1.0)) return false;
+  int o = (int)offset;
+  return count >= 0 && count <= v.memorySize && o <= v.memorySize - count;
+}
+
+//Check that two spans of the memory segment can be used together in a
+//vector operation. Partially overlapping spans would give different results
+//depending on how wide the kernel is, so they are only allowed to be either
+//the same span or not overlap at all.
+template <typename Config>
+inline bool memspans(BasicVM<Config> &v, double a, double b) {
+  int n = v.vectorLength;
+  if (!memspan(v, a, n) || !memspan(v, b, n)) return false;
+  int oa = (int)a;
+  int ob = (int)b;
+  return oa == ob || oa + n <= ob || ob + n <= oa;
+}
+
+//Push a value onto the stack
+template <typename Config>
+inline void push(BasicVM<Config> &v, typename Config::Value val) {
+  if (v.stackPointer < Config::STACK_SIZE) {
+    v.stack[v.stackPointer] = val;
+    v.stackPointer++;
+
+    if (Config::METRICS && v.stackPointer > v.metrics.stackHigh) {
+      v.metrics.stackHigh = v.stackPointer;
+    }
+  }
+}
+
+//Print a value
+inline void print(double val) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%f ", val);
+  dvm_output(buffer);
+}
+
+//Pop a value off of the stack and into a register
+template <typename Config>
+inline void pop(BasicVM<Config> &v, Operand target) {
+  if (v.stackPointer > 0 && target > 0 && target < 13) {
+    v.stackPointer--;
+    regw(target, v, v.stack[v.stackPointer]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Reset the program within a vm
+template <typename Config>
+void dvm_vm_reset(BasicVM<Config> &v) {
+  v.programCursor = 0;
+  v.lastCmp = NEQUAL;
+  v.stackPointer = 0;
+  v.callstackPointer = 0;
+}
+
+//Prepare a VM
+template <typename Config>
+void dvm_vm_clear(BasicVM<Config> &v) {
+  v.program = 0;
+  v.programSize = 0;
+  v.constantCount = 0;
+  v.symbols = v.symbolData;
+  v.image = 0;
+  v.programHash = 0;
+  memset(v.int16Reg, 0, sizeof(v.int16Reg));
+  memset(v.int32Reg, 0, sizeof(v.int32Reg));
+  memset(v.floatReg, 0, sizeof(v.floatReg));
+  v.memory = v.memoryData;
+  v.memorySize = Config::MEMORY_SIZE;
+  memset(v.memoryData, 0, sizeof(v.memoryData));
+  v.vectorLength = 0;
+  v.recording = 0;
+  v.recordedState = 0;
+  v.replaying = 0;
+  v.replayFailed = false;
+  memset(&v.metrics, 0, sizeof(v.metrics));
+  v.metrics.stackSize = Config::STACK_SIZE;
+  v.metrics.callstackSize = Config::CALLSTACK;
+  memset(v.hostCalls, 0, sizeof(v.hostCalls));
+  memset(v.hostNanos, 0, sizeof(v.hostNanos));
+  trace_reset(v);
+  v.source = 0;
+  v.profileGeneration = 0;
+  dvm_vm_reset(v);
+}
+
+//Drop what a vm holds on to (the image it runs and its recording)
+template <typename Config>
+void dvm_vm_release(BasicVM<Config> &v) {
+  dvm_image_release(v.image);
+  v.image = 0;
+  delete v.recording;
+  v.recording = 0;
+}
+
+//Finish loading a program. Vms that don't check the program while running
+//it refuse programs that aren't well formed.
+template <typename Config>
+void dvm_vm_loaded(BasicVM<Config> &v) {
+  if (!Config::CHECKED && !dvm_verify_program(v.program, v.programSize, v.constantCount)) {
+    DEBUG_PLOG(("ERROR: Program is not well formed\n"));
+    v.programSize = 0;
+  }
+
+  v.metrics.program = v.programHash;
+
+  trace_reset(v);
+  v.profileGeneration = 0;
+}
+
+//Point a vm at a program and resolve its symbols
+template <typename Config>
+void dvm_vm_attach(BasicVM<Config> &v, const short *prog, unsigned int size) {
+  dvm_vm_reset(v);
+  dvm_image_release(v.image);
+  v.image = 0;
+
+  if (size > (unsigned int)Config::PROGRAM_SIZE) {
+    DEBUG_PLOG(("ERROR: Program is too large (%u)\n", size));
+    size = 0;
+  }
+
+  v.program = prog;
+  v.programSize = size;
+  v.constantCount = 0;
+  v.source = 0;
+
+  short symbols[IMAGE_SYMBOLS];
+  dvm_resolve_symbols(prog, size, symbols);
+  memcpy(v.symbolData, symbols, sizeof(v.symbolData));
+  v.symbols = v.symbolData;
+}
+
+//Load a program into a vm. The program isn't copied, so it must outlive
+//the vm (or at least the runs using it). This leaves the memory segment
+//alone, so a buffer mapped by the host stays mapped across programs.
+template <typename Config>
+void dvm_vm_load(BasicVM<Config> &v, const short *prog, unsigned int size) {
+  dvm_vm_attach(v, prog, size);
+  v.programHash = dvm_program_hash(v.program, v.programSize, 0, 0);
+  dvm_vm_loaded(v);
+}
+
+//Convert a constant pool into the one the vm reads from
+template <typename Config>
+void dvm_vm_constants(BasicVM<Config> &v, const ProgramConstant *constants, int count) {
+  v.constantCount = count < Config::CONSTANTS ? count : Config::CONSTANTS;
+  for (int i = 0; i < v.constantCount; i++) {
+    v.constants[i] = dvm_constant_value<typename Config::Value>(constants[i]);
+    v.constantInts[i] = constants[i].type == R_IN ? constants[i].i : to_int(constants[i].f);
+  }
+}
+
+//Load a compiled program, including its constant pool, into a vm. Like 
+//bytecode, the source isn't copied, so it must outlive the vm.
+template <typename Config>
+void dvm_vm_load(BasicVM<Config> &v, const ProgramSource &src) {
+  dvm_vm_attach(v, src.program, src.programSize);
+  dvm_vm_constants(v, src.constants, src.constantCount);
+
+  v.programHash = src.hash;
+  v.source = &src;
+  dvm_vm_loaded(v);
+}
+
+//A temporary source would be gone before the vm runs it
+template <typename Config>
+void dvm_vm_load(BasicVM<Config> &v, ProgramSource &&src) = delete;
+
+//Load a program image into a vm. The program and its symbols are used in 
+//place, and the symbols are already resolved, so this doesn't touch the 
+//program. Only the constant pool is converted.
+//The vm keeps the image alive until something else is loaded into it.
+template <typename Config>
+void dvm_vm_load(BasicVM<Config> &v, ProgramImage *img) {
+  dvm_vm_reset(v);
+  dvm_image_retain(img);
+  dvm_image_release(v.image);
+  v.image = img;
+  v.program = image_program(img);
+  v.programSize = img->header->programSize;
+  dvm_vm_constants(v, image_constants(img), img->header->constantCount);
+  v.symbols = image_symbols(img);
+  v.programHash = img->header->programHash;
+  v.source = 0;
+  dvm_vm_loaded(v);
+}
+
+//Map a host buffer as the memory segment of a vm. The buffer is used
+//directly (nothing is copied), and must outlive the runs using it.
+//Passing NULL switches back to the vm's own memory.
+template <typename Config>
+void dvm_vm_map_memory(BasicVM<Config> &v, float *buffer, unsigned int size) {
+  if (buffer) {
+    v.memory = buffer;
+    v.memorySize = size;
+  } else {
+    v.memory = v.memoryData;
+    v.memorySize = Config::MEMORY_SIZE;
+  }
+}
+
+//Registers that aren't part of the config read as 0
+template <typename Config>
+void dvm_vm_get_registers(BasicVM<Config> &v, DVMRegisters &regs) {
+  memset(&regs, 0, sizeof(regs));
+  for (int i = 0; i < Config::INT16_REGS; i++) regs.int16Reg[i] = v.int16Reg[i];
+  for (int i = 0; i < Config::INT32_REGS; i++) regs.int32Reg[i] = v.int32Reg[i];
+  for (int i = 0; i < Config::FLOAT_REGS; i++) regs.floatReg[i] = v.floatReg[i];
+}
+
+template <typename Config>
+void dvm_vm_set_registers(BasicVM<Config> &v, const DVMRegisters &regs) {
+  for (int i = 0; i < Config::INT16_REGS; i++) v.int16Reg[i] = regs.int16Reg[i];
+  for (int i = 0; i < Config::INT32_REGS; i++) v.int32Reg[i] = regs.int32Reg[i];
+  for (int i = 0; i < Config::FLOAT_REGS; i++) v.floatReg[i] = regs.floatReg[i];
+}
+
+//Copy the stack of a vm into out. Returns the number of values on the stack.
+template <typename Config>
+int dvm_vm_get_stack(BasicVM<Config> &v, double *out, int max) {
+  int count = v.stackPointer < max ? v.stackPointer : max;
+  memcpy(out, v.stack, sizeof(double) * count);
+  return v.stackPointer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//Recording and replaying. Only what the program can't decide by itself is
+//recorded: the state of the vm when the recording starts and whenever the
+//host changes it in between runs, the budget of each run, and what host 
+//functions leave on the stack.
+
+template <typename Config>
+void record_state(BasicVM<Config> &v, DVMRecording *r) {
+  unsigned char tag = REC_STATE;
+  rec_put(r, &tag, 1);
+  rec_put(r, v.int16Reg, sizeof(v.int16Reg));
+  rec_put(r, v.int32Reg, sizeof(v.int32Reg));
+  rec_put(r, v.floatReg, sizeof(v.floatReg));
+  rec_put(r, &v.programCursor, sizeof(int));
+  rec_put(r, &v.lastCmp, sizeof(v.lastCmp));
+  rec_put(r, &v.vectorLength, sizeof(int));
+  rec_put(r, &v.stackPointer, sizeof(int));
+  rec_put(r, v.stack, sizeof(double) * v.stackPointer);
+  rec_put(r, &v.callstackPointer, sizeof(int));
+  rec_put(r, v.callstack, sizeof(int) * v.callstackPointer);
+  rec_put(r, &v.memorySize, sizeof(int));
+  rec_put(r, v.memory, sizeof(float) * v.memorySize);
+}
+
+//Hash of everything record_state writes
+template <typename Config>
+unsigned int state_hash(BasicVM<Config> &v) {
+  int lastCmp = v.lastCmp;
+  unsigned int h = dvm_hash_data(v.int16Reg, sizeof(v.int16Reg));
+  h = dvm_hash_data(v.int32Reg, sizeof(v.int32Reg), h);
+  h = dvm_hash_data(v.floatReg, sizeof(v.floatReg), h);
+  h = dvm_hash_data(&v.programCursor, sizeof(int), h);
+  h = dvm_hash_data(&lastCmp, sizeof(int), h);
+  h = dvm_hash_data(&v.vectorLength, sizeof(int), h);
+  h = dvm_hash_data(&v.stackPointer, sizeof(int), h);
+  h = dvm_hash_data(v.stack, sizeof(double) * v.stackPointer, h);
+  h = dvm_hash_data(&v.callstackPointer, sizeof(int), h);
+  h = dvm_hash_data(v.callstack, sizeof(int) * v.callstackPointer, h);
+  h = dvm_hash_data(&v.memorySize, sizeof(int), h);
+  return dvm_hash_data(v.memory, sizeof(float) * v.memorySize, h);
+}
+
+template <typename Config>
+bool replay_state(BasicVM<Config> &v, DVMRecording *r) {
+  static_assert(sizeof(CompareResult) == sizeof(int), "Compare results are recorded as ints");
+
+  unsigned char tag = 0;
+  int lastCmp = -1;
+  int memorySize = -1;
+
+  bool ok = rec_get(r, &tag, 1) && tag == REC_STATE &&
+            rec_get(r, v.int16Reg, sizeof(v.int16Reg)) &&
+            rec_get(r, v.int32Reg, sizeof(v.int32Reg)) &&
+            rec_get(r, v.floatReg, sizeof(v.floatReg)) &&
+            rec_get(r, &v.programCursor, sizeof(int)) &&
+            v.programCursor >= 0 &&
+            rec_get(r, &lastCmp, sizeof(int)) &&
+            lastCmp >= LESS && lastCmp <= NEQUAL &&
+            rec_get(r, &v.vectorLength, sizeof(int)) &&
+            v.vectorLength >= 0 &&
+            rec_get(r, &v.stackPointer, sizeof(int)) &&
+            v.stackPointer >= 0 && v.stackPointer <= Config::STACK_SIZE &&
+            rec_get(r, v.stack, sizeof(double) * v.stackPointer) &&
+            rec_get(r, &v.callstackPointer, sizeof(int)) &&
+            v.callstackPointer >= 0 && v.callstackPointer <= Config::CALLSTACK &&
+            rec_get(r, v.callstack, sizeof(int) * v.callstackPointer) &&
+            rec_get(r, &memorySize, sizeof(int));
+
+  if (!ok) {
+    return false;
+  }
+
+  //Recordings can come from anywhere, so the call stack has to point into
+  //the program before RET can jump to it
+  for (int i = 0; i < v.callstackPointer; i++) {
+    if (v.callstack[i] < 0 || v.callstack[i] >= v.programSize) {
+      return false;
+    }
+  }
+  v.lastCmp = CompareResult(lastCmp);
+
+  //Replay into the vm's own memory if the recorded memory is a different
+  //size from what's mapped
+  if (memorySize != v.memorySize) {
+    if (memorySize < 0 || memorySize > Config::MEMORY_SIZE) {
+      return false;
+    }
+    v.memory = v.memoryData;
+    v.memorySize = memorySize;
+  }
+
+  return rec_get(r, v.memory, sizeof(float) * v.memorySize);
+}
+
+//Stop a replay that has gone off track
+template <typename Config>
+void replay_fail(BasicVM<Config> &v) {
+  DEBUG_PLOG(("ERROR: Replay does not match the recording\n"));
+  v.replayFailed = true;
+  v.programCursor = v.programSize;
+}
+
+template <typename Config>
+void record_call(BasicVM<Config> &v, int id) {
+  unsigned char tag = REC_CALL;
+  unsigned char cid = id;
+  rec_put(v.recording, &tag, 1);
+  rec_put(v.recording, &cid, 1);
+  rec_put(v.recording, &v.stackPointer, sizeof(int));
+  rec_put(v.recording, v.stack, sizeof(double) * v.stackPointer);
+}
+
+//Instead of calling the host function, put what it left on the stack when
+//it was recorded
+template <typename Config>
+void replay_call(BasicVM<Config> &v, int id) {
+  unsigned char tag = 0;
+  unsigned char cid = 0;
+  int stackPointer = -1;
+
+  if (!rec_get(v.replaying, &tag, 1) || tag != REC_CALL ||
+      !rec_get(v.replaying, &cid, 1) || cid != id ||
+      !rec_get(v.replaying, &stackPointer, sizeof(int)) || stackPointer != v.stackPointer ||
+      !rec_get(v.replaying, v.stack, sizeof(double) * v.stackPointer)) {
+    replay_fail(v);
+  }
+}
+
+//The host may have set registers or written to memory since the last run,
+//and the replay has to start the next run from the same place
+template <typename Config>
+void record_changes(BasicVM<Config> &v) {
+  if (state_hash(v) != v.recordedState) {
+    record_state(v, v.recording);
+  }
+}
+
+template <typename Config>
+void record_run(BasicVM<Config> &v) {
+  unsigned char tag = REC_RUN;
+  record_changes(v);
+  rec_put(v.recording, &tag, 1);
+}
+
+template <typename Config>
+void record_budget(BasicVM<Config> &v, unsigned int budget) {
+  unsigned char tag = REC_BUDGET;
+  record_changes(v);
+  rec_put(v.recording, &tag, 1);
+  rec_put(v.recording, &budget, sizeof(budget));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Run at most budget instructions of the program in a vm.
+//Returns the number of instructions executed.
+template <typename Config>
+unsigned int dvm_execute(BasicVM<Config> &v, unsigned int budget) {
+  typedef typename Config::Value Value;
+
+  Instruction ins;
+  Operand opa;
+  Operand opb;
+  Value lValue;
+  Value rValue;
+  short c;
+  unsigned char lbyte;
+  unsigned int executed = 0;
+
+  //Start (or resume where we left of). The symbols were gathered when
+  //the program was loaded.
+  while (v.programCursor < v.programSize && executed < budget) {
+    //Make sure the cursor and call stack are in memory when the profiler's
+    //signal handler looks at them
+    if (Config::PROFILE) {
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+
+    c = v.program[v.programCursor];
+
+    ins = Instruction((c & 0xFF00) >> 8); //The instruction
+    opa = Operand((c & 0x00F0) >> 4);     //Left side operand
+    opb = Operand( c & 0x000F);           //Right side operand
+    lbyte = c & 0x00FF;                   //Symbol
+
+    //Symbols take the place of the operands
+    if (ins_has_symbol(ins)) {
+      opa = R_NONE;
+      opb = R_NONE;
+    }
+
+    lValue = getOperandVal(opa, v);
+    rValue = getOperandVal(opb, v);
+
+    switch (ins) {
+
+      //Moves the right value into a register.
+      case MOV:
+        if (exactInt<Config>(opa, opb)) {
+          v.int32Reg[opa - R_II] = typename Config::Int32(lastConstInt(v));
+        } else if (opa > 0 && opa < 13) {  //Requires a register on the left side
+          regw(opa, v, rValue);
+
+          DEBUG_PLOG(("MOV %f into register %i\n", (double)rValue, opa));
+        }
+        break;
+
+      //Compare two registers or values
+      case CMP:
+        if (exactInt<Config>(opa, opb)) {
+          long long l = v.int32Reg[opa - R_II];
+          long long r = lastConstInt(v);
+          v.lastCmp = l > r ? GREATER : l < r ? LESS : EQUAL;
+        } else if (lValue > rValue) v.lastCmp = GREATER;
+        else if (lValue < rValue) v.lastCmp = LESS;
+        else if (lValue == rValue) v.lastCmp = EQUAL;
+        else v.lastCmp = NEQUAL;
+
+        DEBUG_PLOG(("CMP %f with %f\n", (double)lValue, (double)rValue));
+
+        break;
+
+      //Push a register or a value onto the stack
+      case PUSH:
+        if (opa > 0) {
+          push(v, lValue);
+
+          DEBUG_PLOG(("PUSH %f onto stack\n", (double)lValue));
+        }
+        break;
+
+      //Pop the top item of the stack and put it in a register
+      case POP:
+        if (v.stackPointer > 0 && opa > 0 && opa < 13) {
+          pop(v, opa);
+
+          DEBUG_PLOG(("POP into %i\n", opa));
+        }
+        break;
+
+      //Return from a jump or function call
+      case RET:
+        if (v.callstackPointer > 0) {
+          v.callstackPointer--;
+          v.programCursor = v.callstack[v.callstackPointer];
+
+          //Pop all the registers
+          for (int i = 12; i > 0; i--) {
+            if (hasReg<Config>(Operand(i))) {
+              pop(v, Operand(i));
+            }
+          }
+
+          DEBUG_PLOG(("RETURNED to %i\n", v.programCursor));
+        }
+
+        break;
+
+      //Call a C-function
+      case CALL:
+        if (!op_enabled<Config>(CALL)) break;
+        if (opa > 12 && lValue >= 0 && lValue < 256) {
+          int id = (int)lValue;
+          if (v.replaying) {
+            replay_call(v, id);
+          } else if (dvm_functions[id] && Config::METRICS) {
+            unsigned long long start = dvm_metrics_now();
+            (*dvm_functions[id])(v.stack, v.stackPointer);
+            v.hostNanos[id] += dvm_metrics_now() - start;
+            v.hostCalls[id]++;
+            v.metrics.hostCalled = true;
+          } else if (dvm_functions[id]) {
+            (*dvm_functions[id])(v.stack, v.stackPointer);
+          }
+          if (v.recording) {
+            record_call(v, id);
+          }
+        } else {
+          DEBUG_PLOG(("ERROR: Invalid call to %f\n", (double)lValue));
+        }
+        break;
+
+      //Call a sub routine
+      case DO:
+        if (lbyte < Config::SYMBOLS && v.symbols[lbyte] < v.programSize &&
+            v.callstackPointer < Config::CALLSTACK) {
+          //Push all the registers onto the stack
+          for (int i = 1; i < 13; i++) {
+            if (hasReg<Config>(Operand(i))) {
+              push(v, regr(Operand(i), v));
+            }
+          }
+
+          //Add the jump to the call stack
+          v.callstack[v.callstackPointer] = v.programCursor;
+          v.callstackPointer++;
+
+          if (Config::METRICS && v.callstackPointer > v.metrics.callstackHigh) {
+            v.metrics.callstackHigh = v.callstackPointer;
+          }
+
+          v.programCursor = v.symbols[lbyte];
+
+          DEBUG_PLOG(("Doing subroutine at %i\n", v.programCursor));
+        }
+        break;
+
+      case PRINT:
+        if (!op_enabled<Config>(PRINT)) break;
+        if (opa > 0) {
+          print(lValue);
+        }
+        if (opb > 0) {
+          print(rValue);
+        }
+        break;
+
+      //
+      case PRINTL:
+        if (!op_enabled<Config>(PRINTL)) break;
+        if (opa > 0) {
+          print(lValue);
+        }
+        if (opb > 0) {
+          print(rValue);
+        }
+        dvm_output("\n");
+        break;
+
+      //////////////////////////////////////////////////////////////////////////
+      //Here come the math
+
+      //Increments the value in a register by 1
+      case INC:
+        if (!op_enabled<Config>(INC)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, ++lValue);
+
+          DEBUG_PLOG(("INC register %i\n", opa));
+        }
+        break;
+
+      //Decrements the value in a register by 1
+      case DEC:
+        if (!op_enabled<Config>(DEC)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, --lValue);
+
+          DEBUG_PLOG(("INC register %i\n", opa));
+        }
+        break;
+
+      //Add a value to the value of a register
+      case ADD:
+        if (!op_enabled<Config>(ADD)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, lValue + rValue);
+
+          DEBUG_PLOG(("ADD %f to %f in reg %i", (double)rValue, (double)lValue, opa));
+        }
+        break;
+
+      //Add a value to the value of a register
+      case SUB:
+        if (!op_enabled<Config>(SUB)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, lValue - rValue);
+
+          DEBUG_PLOG(("SUB %f from %f in reg %i", (double)rValue, (double)lValue, opa));
+        }
+        break;
+
+      //Multiply a value with the value of a register
+      case MUL:
+        if (!op_enabled<Config>(MUL)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, lValue * rValue);
+
+          DEBUG_PLOG(("MUL %f with %f in reg %i", (double)lValue, (double)rValue, opa));
+        }
+        break;
+
+      //Divide a value with the value of a register
+      case DIV:
+        if (!op_enabled<Config>(DIV)) break;
+        if (opa > 0 && opa < 13 && rValue > 0) {
+          regw(opa, v, lValue / rValue);
+
+          DEBUG_PLOG(("DIV %f by %f in reg %i", (double)lValue, (double)rValue, opa));
+        }
+        break;
+
+      //Sin of the value in a register
+      case SIN:
+        if (!op_enabled<Config>(SIN)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, sin(lValue));
+
+          DEBUG_PLOG(("SIN %f in reg %i\n", (double)lValue, opa));
+        }
+        break;
+
+      //Cos of the value in a register
+      case COS:
+        if (!op_enabled<Config>(COS)) break;
+        if (opa > 0 && opa < 13) {
+          regw(opa, v, cos(lValue));
+
+          DEBUG_PLOG(("COS %f in reg %i\n", (double)lValue, opa));
+        }
+        break;
+
+      //////////////////////////////////////////////////////////////////////////
+      //Here come the memory operations
+
+      //Load a value from memory into a register. Syntax is register,address.
+      case LOAD:
+        if (!op_enabled<Config>(LOAD)) break;
+        if (opa > 0 && opa < 13 && memspan(v, rValue, 1)) {
+          regw(opa, v, v.memory[(int)rValue]);
+
+          DEBUG_PLOG(("LOAD %f from %i into reg %i\n", v.memory[(int)rValue], (int)rValue, opa));
+        }
+        break;
+
+      //Store a value in memory. Syntax is address,value.
+      case STORE:
+        if (!op_enabled<Config>(STORE)) break;
+        if (opa > 0 && opb > 0 && memspan(v, lValue, 1)) {
+          v.memory[(int)lValue] = rValue;
+
+          DEBUG_PLOG(("STORE %f at %i\n", (double)rValue, (int)lValue));
+        }
+        break;
+
+      //////////////////////////////////////////////////////////////////////////
+      //Here come the vector operations. The operands are addresses in the
+      //memory segment, and the spans are vectorLength elements long.
+
+      //Set the length of the spans
+      case VLEN:
+        if (!op_enabled<Config>(VLEN)) break;
+        if (opa > 0 && lValue >= 0) {
+          //Lengths that don't fit in an int don't fit in memory either, so 
+          //they're clamped rather than converted
+          double length = lValue;
+          v.vectorLength = length < std::numeric_limits<int>::max() ? (int)length : std::numeric_limits<int>::max();
+
+          DEBUG_PLOG(("VLEN %i\n", v.vectorLength));
+        }
+        break;
+
+      //Add the right span to the left span
+      case VADD:
+        if (!op_enabled<Config>(VADD)) break;
+        if (opa > 0 && opb > 0 && memspans(v, lValue, rValue)) {
+          dvm_vec_add(v.memory + (int)lValue, v.memory + (int)rValue, v.vectorLength);
+
+          DEBUG_PLOG(("VADD %i to %i\n", (int)rValue, (int)lValue));
+        }
+        break;
+
+      //Multiply the left span with the right span
+      case VMUL:
+        if (!op_enabled<Config>(VMUL)) break;
+        if (opa > 0 && opb > 0 && memspans(v, lValue, rValue)) {
+          dvm_vec_mul(v.memory + (int)lValue, v.memory + (int)rValue, v.vectorLength);
+
+          DEBUG_PLOG(("VMUL %i with %i\n", (int)lValue, (int)rValue));
+        }
+        break;
+
+      //Multiply each element in the left span with a value
+      case VSCALE:
+        if (!op_enabled<Config>(VSCALE)) break;
+        if (opa > 0 && opb > 0 && memspan(v, lValue, v.vectorLength)) {
+          dvm_vec_scale(v.memory + (int)lValue, rValue, v.vectorLength);
+
+          DEBUG_PLOG(("VSCALE %i by %f\n", (int)lValue, (double)rValue));
+        }
+        break;
+
+      //Push the dot product of two spans onto the stack
+      case VDOT:
+        if (!op_enabled<Config>(VDOT)) break;
+        if (opa > 0 && opb > 0 && memspan(v, lValue, v.vectorLength) && memspan(v, rValue, v.vectorLength)) {
+          push(v, dvm_vec_dot(v.memory + (int)lValue, v.memory + (int)rValue, v.vectorLength));
+
+          DEBUG_PLOG(("VDOT %i with %i\n", (int)lValue, (int)rValue));
+        }
+        break;
+
+      //Push the sum of a span onto the stack
+      case VSUM:
+        if (!op_enabled<Config>(VSUM)) break;
+        if (opa > 0 && memspan(v, lValue, v.vectorLength)) {
+          push(v, dvm_vec_sum(v.memory + (int)lValue, v.vectorLength));
+
+          DEBUG_PLOG(("VSUM %i\n", (int)lValue));
+        }
+        break;
+
+      //Sin of each element in a span
+      case VSIN:
+        if (!op_enabled<Config>(VSIN)) break;
+        if (opa > 0 && memspan(v, lValue, v.vectorLength)) {
+          dvm_vec_sin(v.memory + (int)lValue, v.vectorLength);
+
+          DEBUG_PLOG(("VSIN %i\n", (int)lValue));
+        }
+        break;
+
+      //Cos of each element in a span
+      case VCOS:
+        if (!op_enabled<Config>(VCOS)) break;
+        if (opa > 0 && memspan(v, lValue, v.vectorLength)) {
+          dvm_vec_cos(v.memory + (int)lValue, v.vectorLength);
+
+          DEBUG_PLOG(("VCOS %i\n", (int)lValue));
+        }
+        break;
+
+      //////////////////////////////////////////////////////////////////////////
+      //Here come the jumps
+
+      //Jump if less than
+      case JL:
+        if (v.lastCmp == LESS) jmp(lbyte, v, executed, budget);
+        break;
+
+      //Jump if greater than
+      case JG:
+        if (v.lastCmp == GREATER) jmp(lbyte, v, executed, budget);
+        break;
+
+      //Jump if equals
+      case JE:
+        if (v.lastCmp == EQUAL) jmp(lbyte, v, executed, budget);
+        break;
+
+      //Jump if not equals
+      case JN:
+        if (v.lastCmp != EQUAL) jmp(lbyte, v, executed, budget);
+        break;
+
+      //Jump if less than or equal
+      case JLE:
+        if (v.lastCmp == EQUAL || v.lastCmp == LESS) jmp(lbyte, v, executed, budget);
+        break;
+
+      //Jump if greater than or equal
+      case JGE:
+        if (v.lastCmp == EQUAL || v.lastCmp == GREATER) jmp(lbyte, v, executed, budget);
+        break;
+
+      //Do a jump
+      case JMP:
+        jmp(lbyte, v, executed, budget);
+        break;
+
+      default:
+        break;
+    };
+
+    ++v.programCursor;
+    ++executed;
+  }
+
+  return executed;
+}
+
+//Add what a run did to the metrics
+template <typename Config>
+void dvm_vm_flush_metrics(BasicVM<Config> &v, unsigned long long executed, unsigned long long start) {
+  dvm_metrics_flush(v.metrics, executed, dvm_metrics_now() - start, v.hostCalls, v.hostNanos);
+
+  //The next run starts from where this one left the stacks
+  v.metrics.stackHigh = v.stackPointer;
+  v.metrics.callstackHigh = v.callstackPointer;
+}
+
+//Show the profiler where a vm is, if it's running. Returns false if it
+//isn't, otherwise previous is what to hand to dvm_profile_leave.
+template <typename Config>
+bool dvm_vm_profile_enter(BasicVM<Config> &v, ProfileSlot *&previous) {
+  unsigned int generation = dvm_profile_generation.load(std::memory_order_relaxed);
+  if (!Config::PROFILE || !generation) {
+    return false;
+  }
+
+  if (v.profileGeneration != generation) {
+    dvm_profile_program(v.programHash, v.program, v.programSize, v.source);
+    v.profileGeneration = generation;
+  }
+
+  v.profileSlot.program = v.programHash;
+  v.profileSlot.cursor = &v.programCursor;
+  v.profileSlot.callstack = v.callstack;
+  v.profileSlot.callstackPointer = &v.callstackPointer;
+  v.profileSlot.callstackSize = Config::CALLSTACK;
+  previous = dvm_profile_enter(&v.profileSlot);
+  return true;
+}
+
+//Run the program in a vm until it's done
+template <typename Config>
+void dvm_run(BasicVM<Config> &v) {
+  unsigned long long start = Config::METRICS ? dvm_metrics_now() : 0;
+  unsigned long long executed = 0;
+  ProfileSlot *previous = 0;
+  bool profiled = dvm_vm_profile_enter(v, previous);
+
+  if (v.recording) {
+    record_run(v);
+  }
+
+  while (v.programCursor < v.programSize) {
+    executed += dvm_execute(v, 0xFFFFFFFF);
+  }
+
+  if (v.recording) {
+    v.recordedState = state_hash(v);
+  }
+
+  if (profiled) {
+    dvm_profile_leave(previous);
+  }
+
+  if (Config::METRICS) {
+    dvm_vm_flush_metrics(v, executed, start);
+  }
+}
+
+//Run at most budget instructions of the program in a vm. Returns true if
+//there is more to run, in which case calling this again resumes the
+//program where it left off.
+template <typename Config>
+bool dvm_run(BasicVM<Config> &v, unsigned int budget) {
+  unsigned long long start = Config::METRICS ? dvm_metrics_now() : 0;
+
+  if (v.recording) {
+    record_budget(v, budget);
+  }
+
+  ProfileSlot *previous = 0;
+  bool profiled = dvm_vm_profile_enter(v, previous);
+  unsigned int executed = dvm_execute(v, budget);
+
+  if (v.recording) {
+    v.recordedState = state_hash(v);
+  }
+
+  if (profiled) {
+    dvm_profile_leave(previous);
+  }
+
+  if (Config::METRICS) {
+    dvm_vm_flush_metrics(v, executed, start);
+  }
+
+  return v.programCursor < v.programSize;
+}
+
+//Start recording a vm. This snapshots the current state of the vm, so it
+//can be done before the first run or in between budgeted runs.
+template <typename Config>
+void dvm_record_start(BasicVM<Config> &v) {
+  delete v.recording;
+
+  DVMRecording *r = new DVMRecording;
+  r->readPos = 0;
+
+  unsigned int version = REC_VERSION;
+  unsigned int hash = v.programHash;
+  rec_put(r, REC_MAGIC, 4);
+  rec_put(r, &version, sizeof(version));
+  rec_put(r, &hash, sizeof(hash));
+  record_state(v, r);
+
+  v.recording = r;
+  v.recordedState = state_hash(v);
+}
+
+//Stop recording a vm, and return the recording. It ends with a hash of the
+//state after the last run, so a replay that ends up somewhere else fails.
+template <typename Config>
+DVMRecording *dvm_record_stop(BasicVM<Config> &v) {
+  DVMRecording *r = v.recording;
+  v.recording = 0;
+
+  if (r) {
+    unsigned char tag = REC_END;
+    rec_put(r, &tag, 1);
+    rec_put(r, &v.recordedState, sizeof(v.recordedState));
+  }
+  return r;
+}
+
+//Replay a recording in a vm that has the recorded program loaded. This
+//restores the recorded state and runs the program the same way, without
+//calling any host functions. Returns false if the recording doesn't match
+//the program, or the program didn't do what was recorded or didn't end up
+//in the recorded state.
+template <typename Config>
+bool dvm_replay(BasicVM<Config> &v, DVMRecording *r) {
+  char magic[4];
+  unsigned int version = 0;
+  unsigned int hash = 0;
+
+  r->readPos = 0;
+  if (!rec_get(r, magic, 4) || memcmp(magic, REC_MAGIC, 4) != 0 ||
+      !rec_get(r, &version, sizeof(version)) || version != REC_VERSION ||
+      !rec_get(r, &hash, sizeof(hash)) || hash != v.programHash ||
+      !replay_state(v, r)) {
+    return false;
+  }
+
+  v.replaying = r;
+  v.replayFailed = false;
+
+  //The runs are replayed with the same budgets, so the program is
+  //suspended at the same points, and stops where the recording stopped
+  unsigned char tag;
+  bool ended = false;
+  while (!v.replayFailed && !ended && rec_get(r, &tag, 1)) {
+    unsigned int budget;
+    unsigned int hash;
+
+    if (tag == REC_STATE) {
+      //What the host changed in between runs
+      r->readPos--;
+      if (!replay_state(v, r)) {
+        replay_fail(v);
+      }
+    } else if (tag == REC_RUN) {
+      while (v.programCursor < v.programSize) {
+        dvm_execute(v, 0xFFFFFFFF);
+      }
+    } else if (tag == REC_BUDGET && rec_get(r, &budget, sizeof(budget))) {
+      dvm_execute(v, budget);
+    } else if (tag == REC_END && rec_get(r, &hash, sizeof(hash))) {
+      ended = true;
+      if (hash != state_hash(v)) {
+        replay_fail(v);
+      }
+    } else {
+      replay_fail(v);
+    }
+  }
+
+  bool ok = !v.replayFailed && ended && r->readPos == r->data.size();
+  v.replaying = 0;
+  return ok;
+}
+
+#endif